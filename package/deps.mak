@@ -3,7 +3,9 @@
 #
 
 src/qmail-remote/qmail-remote.h: src/qmail-remote/qmailr.h
+src/qmail-remote/connect.o src/qmail-remote/connect.lo: src/qmail-remote/connect.c src/qmail-remote/qmail-remote.h src/qmail-remote/qmailr.h
 src/qmail-remote/dns.o src/qmail-remote/dns.lo: src/qmail-remote/dns.c src/qmail-remote/qmail-remote.h src/qmail-remote/qmailr.h
+src/qmail-remote/dnscache.o src/qmail-remote/dnscache.lo: src/qmail-remote/dnscache.c src/qmail-remote/qmail-remote.h src/qmail-remote/qmailr.h src/include/smtpd-starttls-proxy/config.h
 src/qmail-remote/qmail-remote-io.o src/qmail-remote/qmail-remote-io.lo: src/qmail-remote/qmail-remote-io.c src/qmail-remote/qmailr.h
 src/qmail-remote/qmail-remote.o src/qmail-remote/qmail-remote.lo: src/qmail-remote/qmail-remote.c src/qmail-remote/qmail-remote.h src/qmail-remote/qmailr.h src/include/smtpd-starttls-proxy/config.h
 src/qmail-remote/qmailr_control.o src/qmail-remote/qmailr_control.lo: src/qmail-remote/qmailr_control.c src/qmail-remote/qmailr.h
@@ -14,7 +16,12 @@ src/qmail-remote/qmailr_tls.o src/qmail-remote/qmailr_tls.lo: src/qmail-remote/q
 src/qmail-remote/qmailr_utils.o src/qmail-remote/qmailr_utils.lo: src/qmail-remote/qmailr_utils.c src/qmail-remote/qmailr.h
 src/qmail-remote/smtproutes.o src/qmail-remote/smtproutes.lo: src/qmail-remote/smtproutes.c src/qmail-remote/qmail-remote.h src/qmail-remote/qmailr.h src/include/smtpd-starttls-proxy/config.h
 src/qmail-remote/tls.o src/qmail-remote/tls.lo: src/qmail-remote/tls.c src/qmail-remote/qmail-remote.h src/qmail-remote/qmailr.h src/include/smtpd-starttls-proxy/config.h
-src/smtpd-starttls-proxy/smtpd-starttls-proxy-io.o src/smtpd-starttls-proxy/smtpd-starttls-proxy-io.lo: src/smtpd-starttls-proxy/smtpd-starttls-proxy-io.c
+src/smtpd-starttls-proxy/smtpd-starttls-proxy-io.o src/smtpd-starttls-proxy/smtpd-starttls-proxy-io.lo: src/smtpd-starttls-proxy/smtpd-starttls-proxy-io.c src/include/smtpd-starttls-proxy/config.h src/smtpd-starttls-proxy/smtpd-starttls-proxy-stats.h src/smtpd-starttls-proxy/smtpd-starttls-proxy-verb.h
+src/smtpd-starttls-proxy/smtpd-starttls-proxy-stats.o src/smtpd-starttls-proxy/smtpd-starttls-proxy-stats.lo: src/smtpd-starttls-proxy/smtpd-starttls-proxy-stats.c src/smtpd-starttls-proxy/smtpd-starttls-proxy-stats.h
+src/tests/sstp-bench-smtpd.o src/tests/sstp-bench-smtpd.lo: src/tests/sstp-bench-smtpd.c
+src/tests/sstp-bench.o src/tests/sstp-bench.lo: src/tests/sstp-bench.c
+src/tests/sstp-spawn-bench.o src/tests/sstp-spawn-bench.lo: src/tests/sstp-spawn-bench.c
+src/tests/sstp-verb-test.o src/tests/sstp-verb-test.lo: src/tests/sstp-verb-test.c src/tests/../smtpd-starttls-proxy/smtpd-starttls-proxy-verb.h
 
 ifeq ($(strip $(STATIC_LIBS_ARE_PIC)),)
 libqmailr.a.xyzzy: src/qmail-remote/qmailr_control.o src/qmail-remote/qmailr_error.o src/qmail-remote/qmailr_smtp.o src/qmail-remote/qmailr_tcpto.o src/qmail-remote/qmailr_tls.o src/qmail-remote/qmailr_utils.o
@@ -22,9 +29,19 @@ else
 libqmailr.a.xyzzy:src/qmail-remote/qmailr_control.lo src/qmail-remote/qmailr_error.lo src/qmail-remote/qmailr_smtp.lo src/qmail-remote/qmailr_tcpto.lo src/qmail-remote/qmailr_tls.lo src/qmail-remote/qmailr_utils.lo
 endif
 qmail-remote: EXTRA_LIBS := ${SOCKET_LIB} ${SYSCLOCK_LIB}
-qmail-remote: src/qmail-remote/qmail-remote.o src/qmail-remote/dns.o src/qmail-remote/smtproutes.o src/qmail-remote/tls.o libqmailr.a.xyzzy -lskadns -ls6dns -lskarnet
+qmail-remote: src/qmail-remote/qmail-remote.o src/qmail-remote/connect.o src/qmail-remote/dns.o src/qmail-remote/dnscache.o src/qmail-remote/smtproutes.o src/qmail-remote/tls.o libqmailr.a.xyzzy -lskadns -ls6dns -lskarnet
 qmail-remote-io: EXTRA_LIBS := ${SYSCLOCK_LIB}
 qmail-remote-io: src/qmail-remote/qmail-remote-io.o libqmailr.a.xyzzy -lskarnet
 smtpd-starttls-proxy-io: EXTRA_LIBS := ${SOCKET_LIB} ${SYSCLOCK_LIB}
 smtpd-starttls-proxy-io: src/smtpd-starttls-proxy/smtpd-starttls-proxy-io.o -lskarnet
+smtpd-starttls-proxy-stats: EXTRA_LIBS :=
+smtpd-starttls-proxy-stats: src/smtpd-starttls-proxy/smtpd-starttls-proxy-stats.o -lskarnet
+sstp-bench: EXTRA_LIBS := ${SOCKET_LIB} ${SYSCLOCK_LIB}
+sstp-bench: src/tests/sstp-bench.o -lskarnet
+sstp-bench-smtpd: EXTRA_LIBS :=
+sstp-bench-smtpd: src/tests/sstp-bench-smtpd.o -lskarnet
+sstp-spawn-bench: EXTRA_LIBS := ${SYSCLOCK_LIB}
+sstp-spawn-bench: src/tests/sstp-spawn-bench.o -lskarnet
+sstp-verb-test: EXTRA_LIBS := ${SYSCLOCK_LIB}
+sstp-verb-test: src/tests/sstp-verb-test.o -lskarnet
 INTERNAL_LIBS := libqmailr.a.xyzzy
@@ -1,10 +1,34 @@
 BIN_TARGETS := \
 smtpd-starttls-proxy-io \
+smtpd-starttls-proxy-stats \
 qmail-remote \
 qmail-remote-io
 
 LIBEXEC_TARGETS :=
 
+TEST_BINS := \
+sstp-verb-test
+
+BENCH_BINS := \
+sstp-bench \
+sstp-bench-smtpd \
+sstp-spawn-bench
+
+EXTRA_TARGETS += $(BENCH_BINS)
+
+BENCH_FLAGS := -n 1000 -c 4
+SPAWN_BENCH_FLAGS := -n 1000
+
+$(BENCH_BINS):
+	exec $(CC) -o $@ $(CFLAGS_ALL) $(LDFLAGS_ALL) $(LDFLAGS_NOSHARED) $^ $(EXTRA_LIBS) $(LDLIBS)
+
+bench: $(BENCH_BINS) smtpd-starttls-proxy-io
+	./sstp-spawn-bench $(SPAWN_BENCH_FLAGS) ./sstp-bench-smtpd
+	./sstp-bench $(BENCH_FLAGS) ./smtpd-starttls-proxy-io ./sstp-bench-smtpd
+	./sstp-bench -u sstp-bench.sock $(BENCH_FLAGS) ./smtpd-starttls-proxy-io -u sstp-bench.sock ./sstp-bench-smtpd
+
+.PHONY: bench
+
 ifdef INSTALL_QMAIL
 
 install: install-qmailr
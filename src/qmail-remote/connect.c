@@ -0,0 +1,237 @@
+/* ISC license. */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <skalibs/tai.h>
+#include <skalibs/djbunix.h>
+#include <skalibs/socket.h>
+#include <skalibs/iopause.h>
+
+#include "qmailr.h"
+#include "qmail-remote.h"
+
+#define STAGGER 250  /* ms, RFC 8305's Connection Attempt Delay */
+
+ /*
+   Happy Eyeballs, RFC 8305 style, for the MX loop.
+   The candidates are grouped by MX preference. In a group, the
+   addresses alternate between families, v6 first, and between MXes.
+   We start connecting to the first candidate, then to the next one
+   every STAGGER ms or as soon as an attempt fails, without waiting
+   for the ones in flight, and keep the first connection that
+   succeeds. A group is only abandoned for the next one when all its
+   candidates have failed, so a backup MX never wins against a slow
+   primary.
+   Attempts that lose the race are not failures: they're marked
+   untried again, so a later call can get to them if the SMTP
+   session on the winner does not work out.
+   dns_stuff() may have started connecting to the best MX already,
+   while waiting for the other answers: that attempt is adopted by
+   the candidate list, and joins the race as if started by it.
+ */
+
+static void mxcand_add (mxcand *c, unsigned int *m, mxip const *mxs, unsigned int from, unsigned int to, char const *storage, int is6)
+{
+  for (unsigned int j = 0 ; ; j++)
+  {
+    unsigned int added = 0 ;
+    for (unsigned int i = from ; i < to ; i++)
+    {
+      if (j >= (is6 ? mxs[i].n6 : mxs[i].n4)) continue ;
+      c[*m].ip = storage + (is6 ? mxs[i].pos6 + (j << 4) : mxs[i].pos4 + (j << 2)) ;
+      c[*m].mx = i ;
+      c[*m].pref = mxs[i].pref ;
+      c[*m].is6 = is6 ;
+      c[*m].done = 0 ;
+      c[*m].fd = -1 ;
+      (*m)++ ; added++ ;
+    }
+    if (!added) break ;
+  }
+}
+
+unsigned int mxcand_list (mxcand *c, mxip const *mxs, unsigned int mxn, char const *storage)
+{
+  unsigned int m = 0 ;
+  for (unsigned int g = 0 ; g < mxn ;)
+  {
+    unsigned int h = g + 1, m6, m4, n6, n4 ;
+    while (h < mxn && mxs[h].pref == mxs[g].pref) h++ ;
+    m6 = m ;
+    mxcand_add(c, &m, mxs, g, h, storage, 1) ;
+    n6 = m - m6 ;
+    m4 = m ;
+    mxcand_add(c, &m, mxs, g, h, storage, 0) ;
+    n4 = m - m4 ;
+    {
+      mxcand tmp[n6 + n4] ;
+      unsigned int k = 0 ;
+      for (unsigned int i = 0 ; i < n6 || i < n4 ; i++)
+      {
+        if (i < n6) tmp[k++] = c[m6 + i] ;
+        if (i < n4) tmp[k++] = c[m4 + i] ;
+      }
+      for (unsigned int i = 0 ; i < k ; i++) c[m6 + i] = tmp[i] ;
+    }
+    g = h ;
+  }
+  return m ;
+}
+
+static void mxcand_update (char const *ip, int is6, int problem)
+{
+  if (!qmailr_tcpto_update(ip, is6, problem))
+    qmailr_tempusys("update ", is6 ? "tcpto6" : "tcpto") ;
+}
+
+static int mxcand_start (char const *ip, int is6, char const *heloip4, char const *heloip6, uint16_t port)
+{
+  int fd = is6 ? socket_tcp6() : socket_tcp4() ;
+  if (fd == -1) qmailr_tempusys("create", " socket") ;
+  if ((is6 ? socket_bind6(fd, heloip6, 0) : socket_bind4(fd, heloip4, 0)) == -1)
+    qmailr_tempusys("bind", " socket") ;
+  if ((is6 ? socket_connect6(fd, ip, port) : socket_connect4(fd, ip, port)) == -1 && errno != EINPROGRESS)
+  {
+    mxcand_update(ip, is6, 0) ;
+    fd_close(fd) ;
+    return -1 ;
+  }
+  return fd ;  /* connected or in progress, iopause will tell */
+}
+
+void mxearly_start (mxearly *e, char const *ip, int is6, char const *heloip4, char const *heloip6)
+{
+  e->tried = 1 ;
+  if (qmailr_tcpto_match(ip, is6)) return ;
+  e->fd = mxcand_start(ip, is6, heloip4, heloip6, e->port) ;
+  if (e->fd == -1) return ;
+  memcpy(e->ip, ip, is6 ? 16 : 4) ;
+  e->is6 = is6 ;
+  e->start = STAMP ;
+}
+
+int mxearly_check (mxearly *e)
+{
+  if (socket_connected(e->fd)) return (e->connected = 1) ;
+  mxcand_update(e->ip, e->is6, errno == ETIMEDOUT) ;
+  fd_close(e->fd) ;
+  e->fd = -1 ;
+  return 0 ;
+}
+
+void mxearly_adopt (mxearly *e, mxcand *c, unsigned int n)
+{
+  if (e->fd == -1) return ;
+  for (unsigned int i = 0 ; i < n ; i++)
+    if (!c[i].mx && c[i].is6 == e->is6 && !memcmp(c[i].ip, e->ip, e->is6 ? 16 : 4))
+    {
+      c[i].fd = e->fd ;
+      c[i].start = e->start ;
+      e->fd = -1 ;
+      return ;
+    }
+  fd_close(e->fd) ;
+  e->fd = -1 ;
+}
+
+static int mxcand_race (mxcand *c, unsigned int n, char const *heloip4, char const *heloip6, uint16_t port, unsigned int timeoutconnect, unsigned int *k)
+{
+  iopause_fd x[n] ;
+  tain deadlines[n] ;
+  unsigned int ind[n] ;
+  unsigned int nx = 0, i = 0 ;
+  tain next = TAIN_ZERO ;
+  tain stagger ;
+
+  tain_from_millisecs(&stagger, STAGGER) ;
+  for (unsigned int j = 0 ; j < n ; j++) if (c[j].fd >= 0)
+  {
+    x[nx].fd = c[j].fd ;
+    x[nx].events = IOPAUSE_WRITE ;
+    ind[nx] = j ;
+    if (timeoutconnect) tain_addsec(deadlines + nx, &c[j].start, timeoutconnect) ;
+    else tain_add_g(deadlines + nx, &tain_infinite_relative) ;
+    tain_add(&next, &c[j].start, &stagger) ;
+    c[j].done = 1 ;
+    c[j].fd = -1 ;
+    nx++ ;
+  }
+  for (;;)
+  {
+    tain deadline ;
+    while (i < n && (c[i].done || qmailr_tcpto_match(c[i].ip, c[i].is6))) c[i++].done = 1 ;
+    if (i < n && (!nx || !tain_less(&STAMP, &next)))
+    {
+      int fd = mxcand_start(c[i].ip, c[i].is6, heloip4, heloip6, port) ;
+      c[i].done = 1 ;
+      if (fd == -1) next = STAMP ;
+      else
+      {
+        x[nx].fd = fd ;
+        x[nx].events = IOPAUSE_WRITE ;
+        ind[nx] = i ;
+        qdeadline(deadlines + nx, timeoutconnect) ;
+        nx++ ;
+        tain_add_g(&next, &stagger) ;
+      }
+      i++ ;
+      continue ;
+    }
+    if (!nx) return -1 ;
+
+    deadline = deadlines[0] ;
+    for (unsigned int j = 1 ; j < nx ; j++)
+      if (tain_less(deadlines + j, &deadline)) deadline = deadlines[j] ;
+    if (i < n && tain_less(&next, &deadline)) deadline = next ;
+    if (iopause_g(x, nx, &deadline) == -1) qmailr_tempusys("iopause") ;
+
+    for (unsigned int j = 0 ; j < nx ; j++)
+    {
+      if (x[j].revents)
+      {
+        if (socket_connected(x[j].fd))
+        {
+          int fd = x[j].fd ;
+          *k = ind[j] ;
+          for (unsigned int l = 0 ; l < nx ; l++) if (l != j)
+          {
+            c[ind[l]].done = 0 ;
+            fd_close(x[l].fd) ;
+          }
+          mxcand_update(c[*k].ip, c[*k].is6, 0) ;
+          return fd ;
+        }
+        mxcand_update(c[ind[j]].ip, c[ind[j]].is6, errno == ETIMEDOUT) ;
+      }
+      else if (!tain_less(&STAMP, deadlines + j)) mxcand_update(c[ind[j]].ip, c[ind[j]].is6, 1) ;
+      else continue ;
+      fd_close(x[j].fd) ;
+      next = STAMP ;
+      nx-- ;
+      x[j] = x[nx] ;
+      deadlines[j] = deadlines[nx] ;
+      ind[j] = ind[nx] ;
+      j-- ;
+    }
+  }
+}
+
+int mxcand_connect (mxcand *c, unsigned int n, char const *heloip4, char const *heloip6, uint16_t port, unsigned int timeoutconnect, unsigned int *k)
+{
+  for (unsigned int g = 0 ; g < n ;)
+  {
+    unsigned int h = g + 1 ;
+    int fd ;
+    while (h < n && c[h].pref == c[g].pref) h++ ;
+    fd = mxcand_race(c + g, h - g, heloip4, heloip6, port, timeoutconnect, k) ;
+    if (fd >= 0)
+    {
+      *k += g ;
+      return fd ;
+    }
+    g = h ;
+  }
+  return -1 ;
+}
@@ -1,6 +1,7 @@
 /* ISC license. */
 
 #include <string.h>
+#include <strings.h>
 #include <stdint.h>
 #include <limits.h>
 #include <stdlib.h>
@@ -24,9 +25,10 @@ typedef struct cnameinfo_s cnameinfo, *cnameinfo_ref ;
 struct cnameinfo_s
 {
   stralloc sa ;
-  size_t atpos ;
+  size_t len ;  /* of the original domain */
   uint16_t id ;
   uint16_t count ;
+  uint8_t lookup : 1 ;
 } ;
 
 typedef struct mxipinfo_s mxipinfo, mxipinfo_ref ;
@@ -37,8 +39,85 @@ struct mxipinfo_s
   size_t pos ;
   uint16_t id4 ;
   uint16_t id6 ;
+  uint16_t pref ;
 } ;
-#define MXIPINFO_ZERO { .ip4 = STRALLOC_ZERO, .ip6 = STRALLOC_ZERO, .id4 = UINT16_MAX, .id6 = UINT16_MAX }
+#define MXIPINFO_ZERO { .ip4 = STRALLOC_ZERO, .ip6 = STRALLOC_ZERO, .id4 = UINT16_MAX, .id6 = UINT16_MAX, .pref = 0 }
+
+
+ /*
+   Answers found in the cache get an id with the high bit set, which
+   skadns never uses (its ids are less than SKADNS_MAXCONCURRENCY),
+   and are queued in ready, to be processed as if skadns had them.
+   0xffff is taken, it means "no query" in dns_stuff().
+   Every query is sent with a slot, telling what the answer is for:
+   the kind of query in the high byte, and the index in cnames[]
+   or mxipi for the kinds that have one. The slot is recorded under
+   the id, so dns_stuff() finds it directly for each answer instead
+   of comparing the id with every query it has in flight.
+ */
+
+#define SLOT_HELO4 0
+#define SLOT_HELO6 1
+#define SLOT_MX 2
+#define SLOT_CNAME 3
+#define SLOT_A 4
+#define SLOT_AAAA 5
+#define slot_make(kind, i) ((uint32_t)(kind) << 24 | (i))
+#define slot_kind(slot) ((slot) >> 24)
+#define slot_index(slot) ((slot) & 0xffffff)
+
+typedef struct hit_s hit, *hit_ref ;
+struct hit_s
+{
+  cdb_data data ;
+  uint32_t slot ;
+} ;
+
+static dnscache cache = DNSCACHE_ZERO ;
+static genalloc hits = GENALLOC_ZERO ;  /* hit */
+static genalloc ready = GENALLOC_ZERO ;  /* uint16_t */
+static genalloc slots = GENALLOC_ZERO ;  /* uint32_t, indexed by skadns id */
+
+static int dns_send (skadns_t *a, uint16_t *id, s6dns_domain_t const *q, uint16_t qtype, tain const *deadline, uint32_t slot)
+{
+  hit h = { .slot = slot } ;
+  size_t len = genalloc_len(uint32_t, &slots) ;
+  if (genalloc_len(hit, &hits) < 0x7fff && dnscache_get(&cache, q->s, q->len, qtype, &h.data))
+  {
+    *id = 0x8000 | genalloc_len(hit, &hits) ;
+    return genalloc_catb(hit, &hits, &h, 1) && genalloc_catb(uint16_t, &ready, id, 1) ;
+  }
+  if (!skadns_send_g(a, id, q, qtype, deadline, deadline)) return 0 ;
+  if (*id >= len)
+  {
+    if (!genalloc_ready(uint32_t, &slots, *id + 1)) return 0 ;
+    genalloc_setlen(uint32_t, &slots, *id + 1) ;
+  }
+  genalloc_s(uint32_t, &slots)[*id] = slot ;
+  return 1 ;
+}
+
+static inline uint32_t dns_slot (uint16_t id)
+{
+  return id & 0x8000 ? genalloc_s(hit, &hits)[id & 0x7fff].slot : genalloc_s(uint32_t, &slots)[id] ;
+}
+
+static inline char const *dns_packet (skadns_t *a, uint16_t id, uint16_t *len)
+{
+  if (id & 0x8000)
+  {
+    cdb_data const *data = &genalloc_s(hit, &hits)[id & 0x7fff].data ;
+    *len = data->len ;
+    return data->s ;
+  }
+  *len = skadns_packetlen(a, id) ;
+  return skadns_packet(a, id) ;
+}
+
+static inline void dns_release (skadns_t *a, uint16_t id)
+{
+  if (!(id & 0x8000)) skadns_release(a, id) ;
+}
 
 static int mx_cmp (void const *a, void const *b)
 {
@@ -47,11 +126,90 @@ static int mx_cmp (void const *a, void const *b)
   return aa->preference < bb-> preference ? -1 : aa->preference > bb->preference ;
 }
 
+ /*
+   Servers often put the addresses of the exchanges in the additional
+   section of an MX answer. We keep them when they're in-bailiwick,
+   i.e. the exchange is in the domain we asked about, so its zone is
+   the one that answered; then no A or AAAA query is needed for that
+   MX and that family. Anything else in the additional section is
+   ignored, and out-of-bailiwick exchanges are queried as usual.
+ */
+
+typedef struct glue_s glue, *glue_ref ;
+struct glue_s
+{
+  s6dns_domain_t name ;
+  char ip[16] ;
+  unsigned int is6 : 1 ;
+} ;
+
+typedef struct mxanswer_s mxanswer, *mxanswer_ref ;
+struct mxanswer_s
+{
+  genalloc mxes ;  /* s6dns_message_rr_mx_t */
+  genalloc glues ;  /* glue */
+} ;
+#define MXANSWER_ZERO { .mxes = GENALLOC_ZERO, .glues = GENALLOC_ZERO }
+
+static int mx_parse_glue (s6dns_message_rr_t const *rr, char const *packet, unsigned int packetlen, unsigned int pos, unsigned int section, void *stuff)
+{
+  mxanswer *data = stuff ;
+  if (section == 4 && rr->rclass == S6DNS_C_IN
+   && (rr->rtype == S6DNS_T_A
+#ifdef SKALIBS_IPV6_ENABLED
+    || rr->rtype == S6DNS_T_AAAA
+#endif
+  ))
+  {
+    glue g = { .name = rr->name, .is6 = rr->rtype == S6DNS_T_AAAA } ;
+    if (rr->rdlength != (g.is6 ? 16 : 4)) return 1 ;  /* not our problem, we'll ask */
+    memcpy(g.ip, packet + pos, rr->rdlength) ;
+    return genalloc_catb(glue, &data->glues, &g, 1) ? 1 : -1 ;
+  }
+  return s6dns_message_parse_answer_mx(rr, packet, packetlen, pos, section, &data->mxes) ;
+}
+
+static int inbailiwick (char const *name, size_t namelen, char const *zone)
+{
+  size_t zonelen = strlen(zone) ;
+  if (zonelen && zone[zonelen - 1] == '.') zonelen-- ;
+  if (namelen == zonelen) return !strncasecmp(name, zone, zonelen) ;
+  return namelen > zonelen && name[namelen - zonelen - 1] == '.' && !strncasecmp(name + namelen - zonelen, zone, zonelen) ;
+}
+
+static int mx_glue (mxipinfo *p, s6dns_domain_t const *exchange, genalloc const *glues)
+{
+  glue const *g = genalloc_s(glue, glues) ;
+  size_t n = genalloc_len(glue, glues) ;
+  int found = 0 ;
+  for (size_t i = 0 ; i < n ; i++)
+  {
+    if (g[i].name.len != exchange->len || strncasecmp(g[i].name.s, exchange->s, exchange->len)) continue ;
+    if (!stralloc_catb(g[i].is6 ? &p->ip6 : &p->ip4, g[i].ip, g[i].is6 ? 16 : 4)) return -1 ;
+    found |= 1 << g[i].is6 ;
+  }
+  return found ;
+}
+
+static void ipme_remove (stralloc *sa, char const *ipme, unsigned int n, unsigned int iplen, int (*cmp)(void const *, void const *))
+{
+  for (size_t k = 0 ; k < sa->len ; k += iplen)
+  {
+    if (bsearch(sa->s + k, ipme, n, iplen, cmp))
+    {
+      memmove(sa->s + k, sa->s + sa->len - iplen, iplen) ;
+      sa->len -= iplen ;
+      k -= iplen ;
+    }
+  }
+}
+
 static unsigned int use_host_as_mx (skadns_t *a, char const *host, genalloc *mxip, stralloc *storage, tain const *deadline)
 {
   size_t hostlen = strlen(host) ;
   unsigned int newreqs = 0 ;
   mxipinfo info = MXIPINFO_ZERO ;
+  unsigned int i = genalloc_len(mxipinfo, mxip) ;
   s6dns_domain_t q ;
   if (!s6dns_domain_fromstring_noqualify_encode(&q, host, hostlen))
   {
@@ -65,14 +223,14 @@ static unsigned int use_host_as_mx (skadns_t *a, char const *host, genalloc *mxi
     dienomem() ;
   }
   if (hostlen > 1 && storage->s[storage->len - 2] == '.') storage->s[--storage->len - 1] = 0 ;
-  if (!skadns_send_g(a, &info.id4, &q, S6DNS_T_A, deadline, deadline))
+  if (!dns_send(a, &info.id4, &q, S6DNS_T_A, deadline, slot_make(SLOT_A, i)))
   {
     skadns_end(a) ;
     qmailr_tempusys("send ", "A", " DNS query") ;
   }
   newreqs++ ;
 #ifdef SKALIBS_IPV6_ENABLED
-  if (!skadns_send_g(a, &info.id6, &q, S6DNS_T_AAAA, deadline, deadline))
+  if (!dns_send(a, &info.id6, &q, S6DNS_T_AAAA, deadline, slot_make(SLOT_AAAA, i)))
   {
     skadns_end(a) ;
     qmailr_tempusys("send ", "AAAA", " DNS query") ;
@@ -92,11 +250,19 @@ static unsigned int use_host_as_mx (skadns_t *a, char const *host, genalloc *mxi
    to avoid compounding network latency. One of the many things that could never
    be done by patching the original qmail-remote.
    1 sender + n-1 recipients are given in eaddr.
-   - loop around CNAME until we get the canonical name, for the n eaddrs
+   - loop around CNAME until we get the canonical name, for the n eaddrs;
+     one chain per distinct domain, shared by all the eaddrs in it.
+     flags & 2: don't canonicalize the sender, flags & 4: nor the recipients
    - either lookup the MX for the host then find all the A and AAAAs of all the MXes,
      or get the A and AAAAs of the host directly (if smtproutes)
    - do not keep the As and AAAAs listed in ipme
    - sort the set of IPs by MX preference
+   As soon as we know the helohost IPs and an address for the best MX,
+   start connecting to it, so the connection is established while we
+   wait for the other answers; the attempt is given back in early.
+   Once it's connected, don't wait for answers about backup MXes
+   anymore: they will only be missing if the best MXes fail.
+   Answers are looked up in, and added to, the shared cache first.
    When done, addrmangle (i.e. quote if needed) all the boxnames in eaddr.
    Shove everything in storage and return the indices:
    in eaddrpos for sender+recipients, in mxipind for the IPs to connect to.
@@ -113,11 +279,12 @@ static unsigned int use_host_as_mx (skadns_t *a, char const *host, genalloc *mxi
 #define qmailr_dtempsys(...) do { skadns_end(&a) ; qmailr_tempsys(__VA_ARGS__) ; } while (0)
 #define qmailr_dtempusys(...) do { skadns_end(&a) ; qmailr_tempusys(__VA_ARGS__) ; } while (0)
 
-unsigned int dns_stuff (char const *helohost, char *heloip4, char *heloip6, char const *host, char const *const *eaddr, unsigned int n, size_t *eaddrpos, genalloc *mxipind, stralloc *storage, unsigned int timeoutdns, char const *ipme4, unsigned int n4, char const *ipme6, unsigned int n6, uint32_t flags)
+unsigned int dns_stuff (char const *helohost, char *heloip4, char *heloip6, char const *host, char const *const *eaddr, unsigned int n, size_t *eaddrpos, genalloc *mxipind, stralloc *storage, unsigned int timeoutdns, char const *ipme4, unsigned int n4, char const *ipme6, unsigned int n6, uint32_t flags, mxearly *early)
 {
   skadns_t a = SKADNS_ZERO ;
   genalloc mxipi = GENALLOC_ZERO ;  /* mxipinfo */
   unsigned int pending = 0 ;
+  unsigned int pendingbackup = 0 ;  /* A/AAAA queries for MXes with a worse preference */
   unsigned int mxn = 0 ;
   stralloc helosa = STRALLOC_ZERO ;
   uint16_t mxid = UINT16_MAX ;
@@ -126,9 +293,14 @@ unsigned int dns_stuff (char const *helohost, char *heloip4, char *heloip6, char
   uint16_t heloid6 = UINT16_MAX ;
 #endif
   tain deadline ;
-  cnameinfo cnames[n] ;
+  genalloc batch = GENALLOC_ZERO ;  /* uint16_t */
+  cnameinfo cnames[n] ;  /* one per distinct domain */
+  unsigned int cnamen = 0 ;
+  unsigned int chain[n] ;  /* eaddr -> cnames, n if no domain */
+  size_t atpos[n] ;
 
   qdeadline(&deadline, timeoutdns) ;
+  dnscache_init(&cache) ;
   if (!skadns_startf_g(&a, &deadline))
     qmailr_tempusys("start asynchronous DNS helper") ;
 
@@ -136,11 +308,11 @@ unsigned int dns_stuff (char const *helohost, char *heloip4, char *heloip6, char
     s6dns_domain_t q ;
     if (!s6dns_domain_fromstring_noqualify_encode(&q, helohost, strlen(helohost)))
       qmailr_dtempusys("DNS-encode helo string") ;
-    if (!skadns_send_g(&a, &heloid4, &q, S6DNS_T_A, &deadline, &deadline))
+    if (!dns_send(&a, &heloid4, &q, S6DNS_T_A, &deadline, slot_make(SLOT_HELO4, 0)))
       qmailr_dtempusys("send ", "A", " DNS query") ;
     pending++ ;
 #ifdef SKALIBS_IPV6_ENABLED
-    if (!skadns_send_g(&a, &heloid6, &q, S6DNS_T_AAAA, &deadline, &deadline))
+    if (!dns_send(&a, &heloid6, &q, S6DNS_T_AAAA, &deadline, slot_make(SLOT_HELO6, 0)))
       qmailr_dtempusys("send ", "AAAA", " DNS query") ;
     pending++ ;
 #endif
@@ -149,28 +321,37 @@ unsigned int dns_stuff (char const *helohost, char *heloip4, char *heloip6, char
   for (unsigned int i = 0 ; i < n ; i++)
   {
     char const *at = strrchr(eaddr[i], '@') ;
-    cnames[i].sa = stralloc_zero ;
-    cnames[i].id = UINT16_MAX ;
     if (at)
     {
-      s6dns_domain_t q ;
       size_t len = strlen(at+1) ;
-      cnames[i].atpos = at - eaddr[i] ;
-      if (!stralloc_catb(&cnames[i].sa, at+1, len)) ddienomem() ;
-      cnames[i].count = 1 ;
-      if (at[1] != '[')
+      int lookup = at[1] != '[' && !(flags & (i ? 4 : 2)) ;
+      unsigned int k = 0 ;
+      atpos[i] = at - eaddr[i] ;
+      for (; k < cnamen ; k++)
+        if (cnames[k].lookup == lookup && cnames[k].len == len && !strncasecmp(cnames[k].sa.s, at+1, len)) break ;
+      chain[i] = k ;
+      if (k < cnamen) continue ;
+      cnames[k].sa = stralloc_zero ;
+      cnames[k].len = len ;
+      cnames[k].id = UINT16_MAX ;
+      cnames[k].count = 1 ;
+      cnames[k].lookup = lookup ;
+      if (!stralloc_catb(&cnames[k].sa, at+1, len)) ddienomem() ;
+      cnamen++ ;
+      if (lookup)
       {
+        s6dns_domain_t q ;
         if (!s6dns_domain_fromstring_noqualify_encode(&q, at+1, len))
           qmailr_dtempusys("DNS-encode recipient domain") ;
-        if (!skadns_send_g(&a, &cnames[i].id, &q, S6DNS_T_CNAME, &deadline, &deadline))
+        if (!dns_send(&a, &cnames[k].id, &q, S6DNS_T_CNAME, &deadline, slot_make(SLOT_CNAME, k)))
           qmailr_dtempusys("send ", "CNAME", " DNS query") ;
         pending++ ;
       }
     }
     else
     {
-      cnames[i].count = 0 ;
-      cnames[i].atpos = strlen(eaddr[i]) ;
+      chain[i] = n ;
+      atpos[i] = strlen(eaddr[i]) ;
     }
   }
 
@@ -179,7 +360,7 @@ unsigned int dns_stuff (char const *helohost, char *heloip4, char *heloip6, char
     s6dns_domain_t q ;
     if (!s6dns_domain_fromstring_noqualify_encode(&q, host, strlen(host)))
       qmailr_dtempusys("DNS-encode host domain") ;
-    if (!skadns_send_g(&a, &mxid, &q, S6DNS_T_MX, &deadline, &deadline))
+    if (!dns_send(&a, &mxid, &q, S6DNS_T_MX, &deadline, slot_make(SLOT_MX, 0)))
       qmailr_dtempusys("send ", "MX", " DNS query") ;
     pending++ ;
   }
@@ -189,23 +370,43 @@ unsigned int dns_stuff (char const *helohost, char *heloip4, char *heloip6, char
     pending += use_host_as_mx(&a, host, &mxipi, storage, &deadline) ;
   }
 
-  while (pending)
+  while (pending && (pending > pendingbackup || !early->connected))
   {
     uint16_t *ids ;
-    iopause_fd x = { .fd = skadns_fd(&a), .events = IOPAUSE_READ } ;
-    int r = iopause_g(&x, 1, &deadline) ;
-    if (r == -1) qmailr_dtempusys("iopause") ;
-    if (!r) qmailr_dtempsys("Timed out waiting for DNS") ;
-    r = skadns_update(&a) ;
-    if (r == -1) qmailr_dtempusys("read DNS answers") ;
-    ids = genalloc_s(uint16_t, &a.list) ;
-    for (size_t j = 0 ; j < genalloc_len(uint16_t, &a.list) ; j++)
+    size_t idn ;
+    int r ;
+    if (genalloc_len(uint16_t, &ready))  /* cache hits first, no need to wait for them */
     {
-      char const *packet = skadns_packet(&a, ids[j]) ;
-      uint16_t packetlen = skadns_packetlen(&a, ids[j]) ;
+      genalloc tmp = batch ;
+      batch = ready ;
+      ready = tmp ;
+      genalloc_setlen(uint16_t, &ready, 0) ;
+      ids = genalloc_s(uint16_t, &batch) ;
+      idn = genalloc_len(uint16_t, &batch) ;
+    }
+    else
+    {
+      iopause_fd x[2] = { { .fd = skadns_fd(&a), .events = IOPAUSE_READ }, { .fd = early->fd, .events = IOPAUSE_WRITE } } ;
+      r = iopause_g(x, 1 + (early->fd >= 0 && !early->connected), &deadline) ;
+      if (r == -1) qmailr_dtempusys("iopause") ;
+      if (!r) qmailr_dtempsys("Timed out waiting for DNS") ;
+      if (early->fd >= 0 && !early->connected && x[1].revents) mxearly_check(early) ;
+      r = skadns_update(&a) ;
+      if (r == -1) qmailr_dtempusys("read DNS answers") ;
+      ids = genalloc_s(uint16_t, &a.list) ;
+      idn = genalloc_len(uint16_t, &a.list) ;
+    }
+    for (size_t j = 0 ; j < idn ; j++)
+    {
+      uint16_t packetlen ;
+      uint32_t slot = dns_slot(ids[j]) ;
+      char const *packet = dns_packet(&a, ids[j], &packetlen) ;
       if (!packet) qmailr_dtempsys("DNS packet reading error") ;
+      if (!(ids[j] & 0x8000)) dnscache_add(&cache, packet, packetlen) ;
 
-      if (ids[j] == heloid4)  /* ipv4 for the helohost */
+      switch (slot_kind(slot))
+      {
+      case SLOT_HELO4 :  /* ipv4 for the helohost */
       {
         s6dns_message_header_t h ;
         r = s6dns_message_parse(&h, packet, packetlen, &s6dns_message_parse_answer_a, &helosa) ;
@@ -215,15 +416,16 @@ unsigned int dns_stuff (char const *helohost, char *heloip4, char *heloip6, char
           if (errno == EBUSY || errno == EIO) qmailr_dtemp("Temporary DNS error while resolving ", "A", "for helohost") ;
           else qmailr_dperm("DNS ", "A", " resolution error") ;
         }
-        skadns_release(&a, heloid4) ;
+        dns_release(&a, heloid4) ;
         pending-- ;
         heloid4 = UINT16_MAX ;
         if (helosa.len >= 4) memcpy(heloip4, helosa.s, 4) ;
         helosa.len = 0 ;
+        break ;
       }
 
 #ifdef SKALIBS_IPV6_ENABLED
-      if (ids[j] == heloid6)  /* ipv4 for the helohost */
+      case SLOT_HELO6 :  /* ipv6 for the helohost */
       {
         s6dns_message_header_t h ;
         r = s6dns_message_parse(&h, packet, packetlen, &s6dns_message_parse_answer_aaaa, &helosa) ;
@@ -233,69 +435,92 @@ unsigned int dns_stuff (char const *helohost, char *heloip4, char *heloip6, char
           if (errno == EBUSY || errno == EIO) qmailr_dtemp("Temporary DNS error while resolving ", "AAAA", "for helohost") ;
           else qmailr_dperm("DNS ", "AAAA", " resolution error") ;
         }
-        skadns_release(&a, heloid6) ;
+        dns_release(&a, heloid6) ;
         pending-- ;
         heloid6 = UINT16_MAX ;
         if (helosa.len >= 16) memcpy(heloip6, helosa.s, 16) ;
         helosa.len = 0 ;
+        break ;
       }
 #endif
 
-      if (ids[j] == mxid)  /* return from MX query */
+      case SLOT_MX :  /* return from MX query */
       {
         s6dns_message_header_t h ;
-        genalloc mxes = GENALLOC_ZERO ;  /* s6dns_message_rr_mx_t */
+        mxanswer ans = MXANSWER_ZERO ;
 
-        r = s6dns_message_parse(&h, packet, packetlen, &s6dns_message_parse_answer_mx, &mxes) ;
+        r = s6dns_message_parse(&h, packet, packetlen, &mx_parse_glue, &ans) ;
         if (r == -1) qmailr_dtempsys("DNS packet parsing error") ;
         if (!r)
         {
           if (errno == EBUSY || errno == EIO) qmailr_dtemp("Temporary DNS error while resolving ", "MX") ;
           else qmailr_dperm("DNS ", "CNAME", " resolution error") ;
         }
-        skadns_release(&a, ids[j]) ;
+        dns_release(&a, ids[j]) ;
         pending-- ;
         mxid = UINT16_MAX ;
         if (r >= 2)  /* we have MXes, ask for their IPs */
         {
-          s6dns_message_rr_mx_t *mxs = genalloc_s(s6dns_message_rr_mx_t, &mxes) ;
-          mxn = genalloc_len(s6dns_message_rr_mx_t, &mxes) ;
+          s6dns_message_rr_mx_t *mxs = genalloc_s(s6dns_message_rr_mx_t, &ans.mxes) ;
+          mxn = genalloc_len(s6dns_message_rr_mx_t, &ans.mxes) ;
           if (!genalloc_readyplus(mxipinfo, &mxipi, mxn)) ddienomem() ;
           qsort(mxs, mxn, sizeof(s6dns_message_rr_mx_t), &mx_cmp) ;
           for (unsigned int i = 0 ; i < mxn ; i++)
           {
             mxipinfo *p = genalloc_s(mxipinfo, &mxipi) + i ;
             unsigned int len ;
+            int found = 0 ;
             if (!stralloc_readyplus(storage, 256)) dienomem() ;
             p->pos = storage->len ;
             len = s6dns_domain_tostring(storage->s + p->pos, 256, &mxs[i].exchange) ;
             if (!len) qmailr_perm("invalid MX name") ;
             storage->len += len ;
             if (storage->s[storage->len - 1] == '.') storage->len-- ;
-            storage->s[storage->len++] = 0 ;
             p->ip4 = p->ip6 = stralloc_zero ;
+            p->id4 = p->id6 = UINT16_MAX ;
+            p->pref = mxs[i].preference ;
+            if (genalloc_len(glue, &ans.glues) && inbailiwick(storage->s + p->pos, storage->len - p->pos, host))
+            {
+              found = mx_glue(p, &mxs[i].exchange, &ans.glues) ;
+              if (found == -1) ddienomem() ;
+              ipme_remove(&p->ip4, ipme4, n4, 4, &qmailr_memcmp4) ;
+#ifdef SKALIBS_IPV6_ENABLED
+              ipme_remove(&p->ip6, ipme6, n6, 16, &qmailr_memcmp16) ;
+#endif
+            }
+            storage->s[storage->len++] = 0 ;
             s6dns_domain_encode(&mxs[i].exchange) ;
-            if (!skadns_send_g(&a, &p->id4, &mxs[i].exchange, S6DNS_T_A, &deadline, &deadline))
-              qmailr_dtempusys("send ", "A", " DNS query") ;
-            pending++ ;
+            if (!(found & 1))
+            {
+              if (!dns_send(&a, &p->id4, &mxs[i].exchange, S6DNS_T_A, &deadline, slot_make(SLOT_A, i)))
+                qmailr_dtempusys("send ", "A", " DNS query") ;
+              pending++ ;
+              if (p->pref != mxs[0].preference) pendingbackup++ ;
+            }
 #ifdef SKALIBS_IPV6_ENABLED
-            if (!skadns_send_g(&a, &p->id6, &mxs[i].exchange, S6DNS_T_AAAA, &deadline, &deadline))
-              qmailr_dtempusys("send ", "AAAA", " DNS query") ;
-            pending++ ;
+            if (!(found & 2))
+            {
+              if (!dns_send(&a, &p->id6, &mxs[i].exchange, S6DNS_T_AAAA, &deadline, slot_make(SLOT_AAAA, i)))
+                qmailr_dtempusys("send ", "AAAA", " DNS query") ;
+              pending++ ;
+              if (p->pref != mxs[0].preference) pendingbackup++ ;
+            }
 #endif
           }
-          genalloc_free(s6dns_message_rr_mx_t, &mxes) ;
         }
         else
         {
           mxn = 1 ;
           pending += use_host_as_mx(&a, host, &mxipi, storage, &deadline) ;
         }
-        continue ;
+        genalloc_free(s6dns_message_rr_mx_t, &ans.mxes) ;
+        genalloc_free(glue, &ans.glues) ;
+        break ;
       }
 
-      for (unsigned int i = 0 ; i < n ; i++) if (ids[j] == cnames[i].id)  /* return from CNAME query */
+      case SLOT_CNAME :  /* return from CNAME query */
       {
+        unsigned int i = slot_index(slot) ;
         s6dns_message_header_t h ;
         s6dns_dpag_t dlist = { .ds = GENALLOC_ZERO, .rtype = S6DNS_T_CNAME } ;
         r = s6dns_message_parse(&h, packet, packetlen, &s6dns_message_parse_answer_domain, &dlist) ;
@@ -305,13 +530,13 @@ unsigned int dns_stuff (char const *helohost, char *heloip4, char *heloip6, char
           if (errno == EBUSY || errno == EIO) qmailr_temp("Temporary DNS error while resolving ", "CNAME") ;
           else qmailr_dperm("DNS ", "CNAME", " resolution error") ;
         }
-        skadns_release(&a, ids[j]) ;
+        dns_release(&a, ids[j]) ;
         pending-- ;
         if (r >= 2)  /* it's a CNAME, loop on it */
         {
           s6dns_domain_t *domain = genalloc_s(s6dns_domain_t, &dlist.ds) ;
           if (cnames[i].count++ >= 100) qmailr_perm("DNS CNAME loop") ;
-          if (!skadns_send_g(&a, &cnames[i].id, domain, S6DNS_T_CNAME, &deadline, &deadline))
+          if (!dns_send(&a, &cnames[i].id, domain, S6DNS_T_CNAME, &deadline, slot_make(SLOT_CNAME, i)))
             qmailr_dtempusys("send ", "CNAME", " DNS query") ;
           pending++ ;
           if (!stralloc_ready(&cnames[i].sa, 256)) ddienomem() ;
@@ -320,79 +545,85 @@ unsigned int dns_stuff (char const *helohost, char *heloip4, char *heloip6, char
           genalloc_free(s6dns_domain_t, &dlist.ds) ;
         }
         else cnames[i].id = UINT16_MAX ;  /* we have the canonical host in cnames[i].sa */
-        continue ;
+        break ;
       }
 
-      for (unsigned int i = 0 ; i < mxn ; i++)
+      case SLOT_A :  /* ipv4 for an MX */
       {
-        mxipinfo *p = genalloc_s(mxipinfo, &mxipi) + i ;
-        if (ids[j] == p->id4)
+        s6dns_message_header_t h ;
+        mxipinfo *p = genalloc_s(mxipinfo, &mxipi) + slot_index(slot) ;
+        r = s6dns_message_parse(&h, packet, packetlen, &s6dns_message_parse_answer_a, &p->ip4) ;
+        if (r == -1) qmailr_dtempsys("DNS packet parsing error") ;
+        if (!r)
         {
-          s6dns_message_header_t h ;
-          r = s6dns_message_parse(&h, packet, packetlen, &s6dns_message_parse_answer_a, &p->ip4) ;
-          if (r == -1) qmailr_dtempsys("DNS packet parsing error") ;
-          if (!r)
-          {
-            if (errno == EBUSY || errno == EIO) qmailr_dtemp("Temporary DNS error while resolving ", "A") ;
-            else qmailr_dperm("DNS ", "A", " resolution error") ;
-          }
-          skadns_release(&a, ids[j]) ;
-          pending-- ;
-          p->id4 = UINT16_MAX ;
-          for (unsigned int k = 0 ; k < p->ip4.len ; k += 4)
-          {
-            if (bsearch(p->ip4.s + k, ipme4, n4, 4, &qmailr_memcmp4))
-            {
-              memmove(p->ip4.s + k, p->ip4.s + p->ip4.len - 4, 4) ;
-              p->ip4.len -= 4 ;
-              k -= 4 ;
-            }
-          }
+          if (errno == EBUSY || errno == EIO) qmailr_dtemp("Temporary DNS error while resolving ", "A") ;
+          else qmailr_dperm("DNS ", "A", " resolution error") ;
         }
+        dns_release(&a, ids[j]) ;
+        pending-- ;
+        if (p->pref != genalloc_s(mxipinfo, &mxipi)->pref) pendingbackup-- ;
+        p->id4 = UINT16_MAX ;
+        ipme_remove(&p->ip4, ipme4, n4, 4, &qmailr_memcmp4) ;
+        break ;
+      }
+
 #ifdef SKALIBS_IPV6_ENABLED
-        else if (ids[j] == p->id6)
+      case SLOT_AAAA :  /* ipv6 for an MX */
+      {
+        s6dns_message_header_t h ;
+        mxipinfo *p = genalloc_s(mxipinfo, &mxipi) + slot_index(slot) ;
+        r = s6dns_message_parse(&h, packet, packetlen, &s6dns_message_parse_answer_aaaa, &p->ip6) ;
+        if (r == -1) qmailr_dtempsys("DNS packet parsing error") ;
+        if (!r)
         {
-          s6dns_message_header_t h ;
-          r = s6dns_message_parse(&h, packet, packetlen, &s6dns_message_parse_answer_aaaa, &p->ip6) ;
-          if (r == -1) qmailr_dtempsys("DNS packet parsing error") ;
-          if (!r)
-          {
-            if (errno == EBUSY || errno == EIO) qmailr_dtemp("Temporary DNS error while resolving ", "AAAA") ;
-            else qmailr_dperm("DNS ", "AAAA", " resolution error") ;
-          }
-          skadns_release(&a, ids[j]) ;
-          pending-- ;
-          p->id6 = UINT16_MAX ;
-          for (unsigned int k = 0 ; k < p->ip6.len ; k += 16)
-          {
-            if (bsearch(p->ip6.s + k, ipme6, n6, 16, &qmailr_memcmp16))
-            {
-              memmove(p->ip6.s + k, p->ip6.s + p->ip6.len - 16, 16) ;
-              p->ip6.len -= 16 ;
-              k -= 16 ;
-            }
-          }
+          if (errno == EBUSY || errno == EIO) qmailr_dtemp("Temporary DNS error while resolving ", "AAAA") ;
+          else qmailr_dperm("DNS ", "AAAA", " resolution error") ;
         }
+        dns_release(&a, ids[j]) ;
+        pending-- ;
+        if (p->pref != genalloc_s(mxipinfo, &mxipi)->pref) pendingbackup-- ;
+        p->id6 = UINT16_MAX ;
+        ipme_remove(&p->ip6, ipme6, n6, 16, &qmailr_memcmp16) ;
+        break ;
+      }
 #endif
       }
     }
+
+    if (!early->tried && mxn && heloid4 == UINT16_MAX
+#ifdef SKALIBS_IPV6_ENABLED
+     && heloid6 == UINT16_MAX
+#endif
+    )
+    {
+      mxipinfo const *p = genalloc_s(mxipinfo, &mxipi) ;
+      if (p->ip6.len && memcmp(heloip6, "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 16))
+        mxearly_start(early, p->ip6.s, 1, heloip4, heloip6) ;
+      else if (p->ip4.len && memcmp(heloip4, "\0\0\0", 4))
+        mxearly_start(early, p->ip4.s, 0, heloip4, heloip6) ;
+    }
   }
   skadns_end(&a) ;  /* we done, buddy */
+  dnscache_commit(&cache) ;
+  genalloc_free(hit, &hits) ;
+  genalloc_free(uint32_t, &slots) ;
+  genalloc_free(uint16_t, &ready) ;
+  genalloc_free(uint16_t, &batch) ;
 
   stralloc_free(&helosa) ;
 
   for (unsigned int i = 0 ; i < n ; i++)
   {
     eaddrpos[i] = storage->len ;
-    if (!qmailr_box_encode(eaddr[i], cnames[i].atpos, storage)) dienomem() ;
-    if (cnames[i].count)
+    if (!qmailr_box_encode(eaddr[i], atpos[i], storage)) dienomem() ;
+    if (chain[i] < n)
     {
       if (!stralloc_catb(storage, "@", 1)) dienomem() ;
-      if (!stralloc_catb(storage, cnames[i].sa.s, cnames[i].sa.len)) dienomem() ;
-      stralloc_free(&cnames[i].sa) ;
+      if (!stralloc_catb(storage, cnames[chain[i]].sa.s, cnames[chain[i]].sa.len)) dienomem() ;
     }
     if (!stralloc_0(storage)) dienomem() ;
   }
+  for (unsigned int i = 0 ; i < cnamen ; i++) stralloc_free(&cnames[i].sa) ;
 
   if (!genalloc_readyplus(mxip, mxipind, mxn)) dienomem() ;
   for (unsigned int i = 0 ; i < mxn ; i++)
@@ -400,6 +631,7 @@ unsigned int dns_stuff (char const *helohost, char *heloip4, char *heloip6, char
     mxip data ;
     mxipinfo *p = genalloc_s(mxipinfo, &mxipi) + i ;
     data.namepos = p->pos ;
+    data.pref = p->pref ;
     data.n4 = p->ip4.len >> 2 ;
     data.pos4 = storage->len ;
     if (!stralloc_catb(storage, p->ip4.s, p->ip4.len)) dienomem() ;
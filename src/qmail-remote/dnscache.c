@@ -0,0 +1,233 @@
+/* ISC license. */
+
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <skalibs/uint16.h>
+#include <skalibs/uint32.h>
+#include <skalibs/bytestr.h>
+#include <skalibs/tai.h>
+#include <skalibs/cdb.h>
+#include <skalibs/cdbmake.h>
+#include <skalibs/stralloc.h>
+#include <skalibs/djbunix.h>
+
+#include <smtpd-starttls-proxy/config.h>
+#include "qmailr.h"
+#include "qmail-remote.h"
+
+#define DNSCACHE_MAXTTL 86400
+#define DNSCACHE_CDB SMTPD_STARTTLS_PROXY_QMAIL_RUN "/qmail-remote/dnscache.cdb"
+#define DNSCACHE_LOCK SMTPD_STARTTLS_PROXY_QMAIL_RUN "/qmail-remote/dnscache.lock"
+
+
+/*
+   A DNS answer cache shared by all the qmail-remote instances.
+   It's a cdb, like smtproutes.cdb, so readers just mmap it, no locking.
+   Keys are the query, i.e. the encoded name, lowercased, and the
+   big-endian qtype. Values are a packed tai for the expiration date,
+   then the answer packet as we got it from skadns, so dns_stuff()
+   can feed it to the very same parsing code as a live answer.
+   The date comes from the smallest TTL in the answer, authority and
+   additional sections, since dns_stuff() may use glue from the latter,
+   or in the authority section only (i.e. the SOA) for NXDOMAIN and
+   NODATA.
+   New answers are kept in RAM during the run, and merged at the end
+   into a new cdb, with the expired entries dropped, which then
+   replaces the old one. Writers are serialized with a lock; if
+   another instance is already writing, we don't wait, we just don't
+   contribute our answers this time.
+*/
+
+static int skipname (char const *s, unsigned int len, unsigned int *pos)
+{
+  for (;;)
+  {
+    unsigned char c ;
+    if (*pos >= len) return 0 ;
+    c = s[*pos] ;
+    if (!c) { (*pos)++ ; return 1 ; }
+    if ((c & 0xc0) == 0xc0) { *pos += 2 ; return *pos <= len ; }
+    if (c & 0xc0) return 0 ;
+    *pos += 1 + c ;
+  }
+}
+
+static uint32_t packet_ttl (char const *s, unsigned int len, unsigned int *qend)
+{
+  uint32_t ttl = DNSCACHE_MAXTTL ;
+  unsigned int pos = 12 ;
+  uint16_t qd, an, ns, ar ;
+  unsigned char rcode ;
+  int soa = 0 ;
+  if (len < 12 || s[2] & 0x02) return 0 ;  /* truncated */
+  rcode = s[3] & 0x0f ;
+  if (rcode && rcode != 3) return 0 ;  /* only NOERROR and NXDOMAIN */
+  uint16_unpack_big(s + 4, &qd) ;
+  uint16_unpack_big(s + 6, &an) ;
+  uint16_unpack_big(s + 8, &ns) ;
+  uint16_unpack_big(s + 10, &ar) ;
+  if (qd != 1 || (!an && !ns)) return 0 ;
+  if (!skipname(s, len, &pos) || pos + 4 > len) return 0 ;
+  *qend = pos ;
+  pos += 4 ;
+  for (unsigned int i = 0 ; i < (an ? (unsigned int)an + ns + ar : ns) ; i++)
+  {
+    uint32_t t ;
+    uint16_t type, rdlen ;
+    unsigned int end ;
+    if (!skipname(s, len, &pos) || pos + 10 > len) return 0 ;
+    uint16_unpack_big(s + pos, &type) ;
+    uint32_unpack_big(s + pos + 4, &t) ;
+    uint16_unpack_big(s + pos + 8, &rdlen) ;
+    end = pos + 10 + rdlen ;
+    if (end > len) return 0 ;
+    if (t < ttl && type != 41) ttl = t ;  /* OPT has no TTL */
+    if (!an && type == 6)
+    {
+     /* RFC 2308: a negative answer lives min(SOA TTL, SOA MINIMUM) */
+      unsigned int p = pos + 10 ;
+      if (!skipname(s, end, &p) || !skipname(s, end, &p) || p + 20 > end) return 0 ;
+      uint32_unpack_big(s + p + 16, &t) ;
+      if (t < ttl) ttl = t ;
+      soa = 1 ;
+    }
+    pos = end ;
+  }
+  return an || soa ? ttl : 0 ;  /* no SOA, no negative caching */
+}
+
+static unsigned int dnscache_key (char *key, char const *name, unsigned int len, uint16_t qtype)
+{
+  memcpy(key, name, len) ;
+  case_lowerb(key, len) ;  /* label lengths are < 64, they don't get touched */
+  uint16_pack_big(key + len, qtype) ;
+  return len + 2 ;
+}
+
+void dnscache_init (dnscache *c)
+{
+  c->ok = cdb_init(&c->map, DNSCACHE_CDB) ;
+}
+
+int dnscache_get (dnscache const *c, char const *name, unsigned int len, uint16_t qtype, cdb_data *data)
+{
+  char key[len + 2] ;
+  tai expire ;
+  if (!c->ok) return 0 ;
+  if (cdb_find(&c->map, data, key, dnscache_key(key, name, len, qtype)) <= 0) return 0 ;
+  if (data->len < TAI_PACK + 12) return 0 ;
+  tai_unpack(data->s, &expire) ;
+  if (!tai_less(tain_secp(&STAMP), &expire)) return 0 ;
+  data->s += TAI_PACK ;
+  data->len -= TAI_PACK ;
+  return 1 ;
+}
+
+void dnscache_add (dnscache *c, char const *packet, unsigned int len)
+{
+  unsigned int qend ;
+  uint32_t ttl = packet_ttl(packet, len, &qend) ;
+  if (!ttl) return ;
+  {
+    tai t ;
+    size_t pos = c->fresh.len ;
+    unsigned int keylen = qend - 12 + 2 ;
+    uint16_t qtype ;
+    uint16_unpack_big(packet + qend, &qtype) ;
+    if (!stralloc_readyplus(&c->fresh, 6 + keylen + TAI_PACK + len)) dienomem() ;
+    uint16_pack_big(c->fresh.s + pos, keylen) ;
+    uint32_pack_big(c->fresh.s + pos + 2, TAI_PACK + len) ;
+    dnscache_key(c->fresh.s + pos + 6, packet + 12, qend - 12, qtype) ;
+    tai_uint(&t, ttl) ;
+    tai_add(&t, tain_secp(&STAMP), &t) ;
+    tai_pack(c->fresh.s + pos + 6 + keylen, &t) ;
+    memcpy(c->fresh.s + pos + 6 + keylen + TAI_PACK, packet, len) ;
+    c->fresh.len += 6 + keylen + TAI_PACK + len ;
+  }
+}
+
+static int fresh_has (stralloc const *fresh, size_t end, char const *key, uint32_t keylen)
+{
+  for (size_t pos = 0 ; pos < end ;)
+  {
+    uint16_t klen ;
+    uint32_t dlen ;
+    uint16_unpack_big(fresh->s + pos, &klen) ;
+    uint32_unpack_big(fresh->s + pos + 2, &dlen) ;
+    if (klen == keylen && !memcmp(fresh->s + pos + 6, key, keylen)) return 1 ;
+    pos += 6 + klen + dlen ;
+  }
+  return 0 ;
+}
+
+static void dnscache_write (stralloc const *fresh)
+{
+  static size_t const cdblen = sizeof(DNSCACHE_CDB) - 1 ;
+  cdbmaker cm = CDBMAKER_ZERO ;
+  cdb old = CDB_ZERO ;
+  int hasold ;
+  int fdc ;
+  char tmp[cdblen + 8] ;
+  int fdl = openc_create(DNSCACHE_LOCK) ;
+  if (fdl == -1) return ;
+  if (fd_lock(fdl, 1, 1) < 1) goto end ;
+
+  memcpy(tmp, DNSCACHE_CDB, cdblen) ;
+  memcpy(tmp + cdblen, ":XXXXXX", 8) ;
+  fdc = mkstemp(tmp) ;
+  if (fdc == -1) goto end ;
+  if (!cdbmake_start(&cm, fdc)) goto err ;
+  for (size_t pos = 0 ; pos < fresh->len ;)
+  {
+    uint16_t klen ;
+    uint32_t dlen ;
+    uint16_unpack_big(fresh->s + pos, &klen) ;
+    uint32_unpack_big(fresh->s + pos + 2, &dlen) ;
+    if (!fresh_has(fresh, pos, fresh->s + pos + 6, klen)
+     && !cdbmake_add(&cm, fresh->s + pos + 6, klen, fresh->s + pos + 6 + klen, dlen)) goto err ;
+    pos += 6 + klen + dlen ;
+  }
+
+  hasold = cdb_init(&old, DNSCACHE_CDB) ;  /* the current one, it may have changed since dnscache_init */
+  if (hasold)
+  {
+    cdb_data key, data ;
+    uint32_t kpos = CDB_TRAVERSE_INIT() ;
+    while (cdb_traverse_next(&old, &key, &data, &kpos) > 0)
+    {
+      tai expire ;
+      if (data.len < TAI_PACK) continue ;
+      tai_unpack(data.s, &expire) ;
+      if (!tai_less(tain_secp(&STAMP), &expire)) continue ;
+      if (fresh_has(fresh, fresh->len, key.s, key.len)) continue ;
+      if (!cdbmake_add(&cm, key.s, key.len, data.s, data.len))
+      {
+        cdb_free(&old) ;
+        goto err ;
+      }
+    }
+    cdb_free(&old) ;
+  }
+  if (!cdbmake_finish(&cm) || fsync(fdc) == -1) goto err ;
+  fd_close(fdc) ;
+  if (rename(tmp, DNSCACHE_CDB) == -1) unlink_void(tmp) ;
+  goto end ;
+
+ err:
+  fd_close(fdc) ;
+  unlink_void(tmp) ;
+ end:
+  fd_close(fdl) ;
+}
+
+void dnscache_commit (dnscache *c)
+{
+  if (c->fresh.len) dnscache_write(&c->fresh) ;
+  stralloc_free(&c->fresh) ;
+  if (c->ok) cdb_free(&c->map) ;
+  c->ok = 0 ;
+}
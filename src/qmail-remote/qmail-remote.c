@@ -15,7 +15,6 @@
 #include <skalibs/sig.h>
 #include <skalibs/tai.h>
 #include <skalibs/djbunix.h>
-#include <skalibs/socket.h>
 #include <skalibs/ip46.h>
 #include <skalibs/unix-timed.h>
 #include <skalibs/lolstdio.h>
@@ -96,7 +95,7 @@ int main (int argc, char const *const *argv)
   stralloc ipme6 = STRALLOC_ZERO ;
   qmailr_tls qtls = QMAILR_TLS_ZERO ;
   smtproutes routes = SMTPROUTES_ZERO ;
-  unsigned int timeoutconnect = 60, timeoutremote = 1200, timeoutdns = 0 ;
+  unsigned int timeoutconnect = 60, timeoutremote = 1200, timeoutdns = 0, cnamelookup = 2 ;
   char const *host ;
   size_t mepos, helopos, hostpos = 0 ;
   uint16_t port = 25 ;
@@ -126,6 +125,8 @@ int main (int argc, char const *const *argv)
   if (r == -1) qmailr_tempusys("read ", "control/timeoutremote") ;
   r = qmailr_control_readint("control/timeoutdns", &timeoutdns, &storage) ;
   if (r == -1) qmailr_tempusys("read ", "control/timeoutdns") ;
+  r = qmailr_control_readint("control/cnamelookup", &cnamelookup, &storage) ;
+  if (r == -1) qmailr_tempusys("read ", "control/cnamelookup") ;
 
   if (!qmailr_control_readiplist("control/ipme", &ipme4, &ipme6))
     qmailr_tempusys("read ", "control/ipme") ;
@@ -153,13 +154,19 @@ int main (int argc, char const *const *argv)
   {
     genalloc mxipind = GENALLOC_ZERO ;
     mxip *mxs ;
+    mxearly early = MXEARLY_ZERO ;
     int do4 = 1, do6 = 1 ;
     char heloip4[4] = "\0\0\0" ;
     char heloip6[16] = "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0" ;
     size_t ntot = 0 ;
     unsigned int pass = 1 + (qtls.flagwanttls && qtls.strictness == 1) ;
     size_t eaddrpos[argc] ;
-    unsigned int mxn = dns_stuff(storage.s + helopos, heloip4, heloip6, hostpos ? storage.s + hostpos : host, argv, argc, eaddrpos, &mxipind, &storage, timeoutdns, ipme4.s, ipme4.len >> 2, ipme6.s, ipme6.len >> 4, !hostpos) ;
+    unsigned int mxn ;
+    uint32_t dnsflags = !hostpos ;
+    if (cnamelookup < 2) dnsflags |= 2 ;
+    if (!cnamelookup) dnsflags |= 4 ;
+    early.port = port ;
+    mxn = dns_stuff(storage.s + helopos, heloip4, heloip6, hostpos ? storage.s + hostpos : host, argv, argc, eaddrpos, &mxipind, &storage, timeoutdns, ipme4.s, ipme4.len >> 2, ipme6.s, ipme6.len >> 4, dnsflags, &early) ;
     if (!mxn) qmailr_perm("No suitable MX found for remote host") ;
     stralloc_free(&ipme4) ;
     stralloc_free(&ipme6) ;
@@ -176,55 +183,20 @@ int main (int argc, char const *const *argv)
     }
     if (!ntot) qmailr_perm("No suitable IP addresses for ", "MX") ;
 
-    while (pass--)
     {
-      if (!pass && qtls.strictness == 1) qtls.flagwanttls = 0 ;
-      for (unsigned int i = 0 ; i < mxn ; i++)
+      mxcand cands[ntot] ;
+      ntot = mxcand_list(cands, mxs, mxn, storage.s) ;
+      mxearly_adopt(&early, cands, ntot) ;
+      while (pass--)
       {
-#ifdef SKALIBS_IPV6_ENABLED
-        for (unsigned int j = 0 ; j < mxs[i].n6 ; j++)
+        if (!pass && qtls.strictness == 1) qtls.flagwanttls = 0 ;
+        for (size_t i = 0 ; i < ntot ; i++) cands[i].done = 0 ;
+        for (;;)
         {
-          char const *ip = storage.s + mxs[i].pos6 + (j << 4) ;
-          tain deadline ;
-          int fd ;
-          if (qmailr_tcpto_match(ip, 1)) continue ;
-          fd = socket_tcp6() ;
-          if (fd == -1) qmailr_tempusys("create", " socket") ;
-          if (socket_bind6(fd, heloip6, 0) == -1) qmailr_tempusys("bind", " socket") ;
-          qdeadline(&deadline, timeoutconnect) ;
-          if (!socket_deadlineconnstamp6_g(fd, ip, port, &deadline))
-          {
-            if (!qmailr_tcpto_update(ip, 1, errno == ETIMEDOUT))
-              qmailr_tempusys("update ", "tcpto6") ;
-            fd_close(fd) ;
-            continue ;
-          }
-          if (!qmailr_tcpto_update(ip, 1, 0))
-            qmailr_tempusys("update ", "tcpto6") ;
-          attempt_smtp(fd, ip, 1, timeoutconnect, timeoutremote, &qtls, helopos, eaddrpos, argc, mxs[i].namepos, storage.s) ;
-          fd_close(fd) ;
-        }
-#endif
-        for (unsigned int j = 0 ; j < mxs[i].n4 ; j++)
-        {
-          char const *ip = storage.s + mxs[i].pos4 + (j << 2) ;
-          tain deadline ;
-          int fd ;
-          if (qmailr_tcpto_match(ip, 0)) continue ;
-          fd = socket_tcp4() ;
-          if (fd == -1) qmailr_tempusys("create socket") ;
-          if (socket_bind4(fd, heloip4, 0) == -1) qmailr_tempusys("bind", " socket") ;
-          qdeadline(&deadline, timeoutconnect) ;
-          if (!socket_deadlineconnstamp4_g(fd, ip, port, &deadline))
-          {
-            if (!qmailr_tcpto_update(ip, 0, errno == ETIMEDOUT))
-              qmailr_tempusys("update ", "tcpto") ;
-            fd_close(fd) ;
-            continue ;
-          }
-          if (!qmailr_tcpto_update(ip, 0, 0))
-            qmailr_tempusys("update ", "tcpto") ;
-          attempt_smtp(fd, ip, 0, timeoutconnect, timeoutremote, &qtls, helopos, eaddrpos, argc, mxs[i].namepos, storage.s) ;
+          unsigned int k ;
+          int fd = mxcand_connect(cands, ntot, heloip4, heloip6, port, timeoutconnect, &k) ;
+          if (fd == -1) break ;
+          attempt_smtp(fd, cands[k].ip, cands[k].is6, timeoutconnect, timeoutremote, &qtls, helopos, eaddrpos, argc, mxs[cands[k].mx].namepos, storage.s) ;
           fd_close(fd) ;
         }
       }
@@ -7,6 +7,7 @@
 #include <stdint.h>
 
 #include <skalibs/gccattributes.h>
+#include <skalibs/tai.h>
 #include <skalibs/cdb.h>
 #include <skalibs/stralloc.h>
 #include <skalibs/genalloc.h>
@@ -26,10 +27,62 @@ struct mxip_s
   size_t pos6 ;
   uint16_t n4 ;
   uint16_t n6 ;
+  uint16_t pref ;
 } ;
 #define MXIP_ZERO { 0 }
 
-extern unsigned int dns_stuff (char const *, char *, char *, char const *, char const *const *, unsigned int, size_t *, genalloc *, stralloc *, unsigned int, char const *, unsigned int, char const *, unsigned int, uint32_t) ;
+typedef struct mxearly_s mxearly, *mxearly_ref ;
+struct mxearly_s
+{
+  tain start ;
+  int fd ;
+  uint16_t port ;
+  uint8_t is6 : 1 ;
+  uint8_t tried : 1 ;
+  uint8_t connected : 1 ;
+  char ip[16] ;
+} ;
+#define MXEARLY_ZERO { .start = TAIN_ZERO, .fd = -1, .port = 25, .is6 = 0, .tried = 0, .connected = 0, .ip = { 0 } }
+
+extern unsigned int dns_stuff (char const *, char *, char *, char const *, char const *const *, unsigned int, size_t *, genalloc *, stralloc *, unsigned int, char const *, unsigned int, char const *, unsigned int, uint32_t, mxearly *) ;
+
+
+ /* connect */
+
+typedef struct mxcand_s mxcand, *mxcand_ref ;
+struct mxcand_s
+{
+  char const *ip ;
+  unsigned int mx ;
+  uint16_t pref ;
+  uint8_t is6 : 1 ;
+  uint8_t done : 1 ;
+  int fd ;
+  tain start ;
+} ;
+
+extern unsigned int mxcand_list (mxcand *, mxip const *, unsigned int, char const *) ;
+extern int mxcand_connect (mxcand *, unsigned int, char const *, char const *, uint16_t, unsigned int, unsigned int *) ;
+extern void mxearly_start (mxearly *, char const *, int, char const *, char const *) ;
+extern int mxearly_check (mxearly *) ;
+extern void mxearly_adopt (mxearly *, mxcand *, unsigned int) ;
+
+
+ /* dnscache */
+
+typedef struct dnscache_s dnscache, *dnscache_ref ;
+struct dnscache_s
+{
+  cdb map ;
+  stralloc fresh ;
+  int ok ;
+} ;
+#define DNSCACHE_ZERO { .map = CDB_ZERO, .fresh = STRALLOC_ZERO, .ok = 0 }
+
+extern void dnscache_init (dnscache *) ;
+extern int dnscache_get (dnscache const *, char const *, unsigned int, uint16_t, cdb_data *) ;
+extern void dnscache_add (dnscache *, char const *, unsigned int) ;
+extern void dnscache_commit (dnscache *) ;
 
 
 /* smtproutes */
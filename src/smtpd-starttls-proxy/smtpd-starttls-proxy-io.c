@@ -1,84 +1,493 @@
 /* ISC license. */
 
+#include <skalibs/nonposix.h>
+#include <skalibs/sysdeps.h>
+
+#include <stdint.h>
+#include <limits.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
 #include <strings.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/uio.h>
+#include <sys/wait.h>
+#include <fcntl.h>
 
 #include <skalibs/gccattributes.h>
 #include <skalibs/types.h>
+#include <skalibs/allreadwrite.h>
+#include <skalibs/posixplz.h>
 #include <skalibs/sgetopt.h>
 #include <skalibs/buffer.h>
+#include <skalibs/bufalloc.h>
+#include <skalibs/alloc.h>
+#include <skalibs/stralloc.h>
+#include <skalibs/genalloc.h>
 #include <skalibs/error.h>
 #include <skalibs/strerr.h>
 #include <skalibs/tai.h>
 #include <skalibs/djbunix.h>
+#include <skalibs/cspawn.h>
 #include <skalibs/iopause.h>
+#include <skalibs/socket.h>
+#include <skalibs/sig.h>
 #include <skalibs/skamisc.h>
 #include <skalibs/exec.h>
 #include <skalibs/unix-timed.h>
 
 #include <s6/config.h>
 
-#define USAGE "smtpd-starttls-proxy-io [ -- ] prog..."
+#include <smtpd-starttls-proxy/config.h>
+
+#if defined(SKALIBS_HASSPLICE) && defined(SMTPD_STARTTLS_PROXY_USE_IO_URING)
+# define USE_IO_URING
+# include <sys/syscall.h>
+# include <linux/io_uring.h>
+#endif
+
+#include "smtpd-starttls-proxy-stats.h"
+#include "smtpd-starttls-proxy-verb.h"
+
+#define USAGE "smtpd-starttls-proxy-io [ -l localname ] [ -c ehlocache ] [ -C ehlottl ] [ -t timinglog ] [ -s statsfile ] [ -i idletimeout ] [ -b bannertimeout ] [ -m commandtimeout ] [ -k handshaketimeout ] [ -r reclines ] [ -u socket ] [ -- ] prog..."
 #define dieusage() strerr_dieusage(100, USAGE)
 
 #define INSIZE 1024
 #define OUTSIZE 1920
 
-#define reset_timeout() tain_addsec_g(&deadline, 300)
+ /*
+   Output buffers grow as needed. We stop reading from a peer when
+   what it makes us write reaches OUTHIGH bytes, and resume when it
+   is down to OUTLOW. OUTMAX is only reached by a peer that does not
+   read at all while we keep writing, i.e. never with flow control.
+ */
+#define OUTLOW 2048
+#define OUTHIGH 8192
+#define OUTMAX 65536
+
 
-#define MAXCBQ 16
+#define SPLICE_CHUNK 65536
 
 typedef struct io_s io_t, *io_t_ref ;
 struct io_s {
   buffer in ;
-  buffer out ;
-  size_t w ;
+  bufalloc out ;
+  size_t w ;  /* bytes of in already scanned for a newline */
+  int paused ;
   char line[INSIZE] ;
   char inbuf[INSIZE] ;
-  char outbuf[OUTSIZE] ;
 } ;
 
 typedef int cmdfunc (char const *) ;
 typedef cmdfunc *cmdfunc_ref ;
 
-struct cmdmap_s
-{
-  char const *name ;
-  cmdfunc_ref f ;
-} ;
-
 typedef int cbfunc (char const *) ;
 typedef cbfunc *cbfunc_ref ;
 
+typedef struct cbentry_s cbentry, *cbentry_ref ;
+struct cbentry_s
+{
+  cbfunc_ref f ;
+  char const *answer ;
+} ;
+
 static io_t io[2] =
 {
-  { .in = BUFFER_INIT(&buffer_read, 0, io[0].inbuf, INSIZE), .out = BUFFER_INIT(&buffer_write, 1, io[0].outbuf, OUTSIZE), .w = 0 },
-  { .w = 0 }
+  { .in = BUFFER_INIT(&buffer_read, 0, io[0].inbuf, INSIZE), .out = BUFALLOC_ZERO, .w = 0, .paused = 0 },
+  { .out = BUFALLOC_ZERO, .w = 0, .paused = 0 }
 } ;
 
 static int fdctl ;
 static int sslfds[2] ;
+ /*
+   Deadlines, in seconds, 0 meaning none. idle is reset by any
+   progress. banner runs from the spawn of the server to its first
+   line. command is how long the client has to send a full command
+   line when it has nothing left to read from us: it is not reset by
+   a trickle of bytes.
+ */
+static unsigned int timeout_idle = 300 ;
+static unsigned int timeout_banner = 0 ;
+static unsigned int timeout_command = 0 ;
+static unsigned int timeout_handshake = 300 ;
+static tain deadline ;
+static tain deadline_banner ;
+static tain deadline_command ;
+static int bannerwait = 0 ;
+
+static void deadline_set (tain *d, unsigned int t)
+{
+  if (t) tain_addsec_g(d, t) ;
+  else tain_add_g(d, &tain_infinite_relative) ;
+}
+
+#define reset_timeout() deadline_set(&deadline, timeout_idle)
+#define reset_command_timeout() deadline_set(&deadline_command, timeout_command)
+
+static void banner_arm (void)
+{
+  bannerwait = 1 ;
+  deadline_set(&deadline_banner, timeout_banner) ;
+}
+
 static int wantexec = 0 ;
+static int backend = 0 ;  /* 0: not spawned yet, 1: running, -1: gone */
+static char const *const *backend_argv ;
+static char const *backend_socket = 0 ;
+static pid_t backendpid = 0 ;
+
+ /* lazy mode: answers we give before the server is spawned */
+static char const *lazybanner = 0 ;
+static char const *lazyehlo ;
+static char const *lazyquit ;
+static char ehloline[INSIZE] ;
+static int ehlopending = 0 ;  /* the client's EHLO was answered without the server */
+
+static char const *ehlocache = 0 ;
+static unsigned int ehlottl = 300 ;
+static stralloc ehlosa = STRALLOC_ZERO ;  /* EHLO answer being built */
+
+
+ /*
+   Timing log: one line per session, written when the session ends,
+   with the time elapsed between the connection and each phase, to
+   find out who's slow - the server, the TLS engine or the client.
+ */
+
+enum phase_e
+{
+  PHASE_BANNER,
+  PHASE_EHLO,
+  PHASE_STARTTLS,
+  PHASE_HANDSHAKE,
+  PHASE_RELAY,
+  PHASE_N
+} ;
+
+static char const *const phase_name[PHASE_N] = { "banner", "ehlo", "starttls", "handshake", "relay" } ;
+
+static int timingfd = -1 ;
+static tain timing_start ;
+static tain timing_wallclock ;
+static tain timing_phase[PHASE_N] ;
+static unsigned int timing_seen = 0 ;
+static uint64_t bytes_in = 0 ;
+static uint64_t bytes_out = 0 ;
+
+static sstpstats *stats = 0 ;
+
+#define stats_inc(field) do { if (stats) sstpstats_inc(&stats->field) ; } while (0)
+
+static void stats_init (char const *file)
+{
+  struct stat st ;
+  void *p ;
+  int fd = open3(file, O_RDWR | O_CREAT | O_CLOEXEC, 0666) ;  /* MAP_SHARED with PROT_WRITE needs it readable */
+  if (fd == -1) goto err ;
+  if (fstat(fd, &st) == -1) goto errclose ;
+  if (st.st_size < (off_t)sizeof(sstpstats) && ftruncate(fd, sizeof(sstpstats)) == -1) goto errclose ;
+  p = mmap(0, sizeof(sstpstats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) ;
+  if (p == MAP_FAILED) goto errclose ;
+  fd_close(fd) ;
+  stats = p ;
+  if (memcmp(stats->magic, SSTPSTATS_MAGIC, 8))
+  {
+    static char const zero[8] = { 0 } ;
+    if (memcmp(stats->magic, zero, 8))
+    {
+      strerr_warnw2x(file, " is not a stats file, not updating it") ;
+      munmap(p, sizeof(sstpstats)) ;
+      stats = 0 ;
+      return ;
+    }
+    memcpy(stats->magic, SSTPSTATS_MAGIC, 8) ;  /* new file; concurrent writers write the same thing */
+  }
+  return ;
+
+ errclose:
+  fd_close(fd) ;
+ err:
+  strerr_warnwu2sys("map ", file) ;
+}
+
+static void stats_handshake (tain const *start)
+{
+  tain d ;
+  int ms ;
+  unsigned int i = 0 ;
+  if (!stats) return ;
+  tain_now_g() ;
+  tain_sub(&d, &STAMP, start) ;
+  ms = tain_to_millisecs(&d) ;
+  if (ms < 0) ms = INT_MAX ;
+  while (i < SSTPSTATS_HISTO - 1 && (unsigned int)ms >= 1U << i) i++ ;
+  sstpstats_inc(stats->handshake_ms + i) ;
+}
+
+static void timing_init (void)
+{
+  if (timingfd < 0) return ;
+  tain_wallclock_read(&timing_wallclock) ;
+  timing_start = STAMP ;
+}
+
+static inline void phase_mark (enum phase_e ph)
+{
+  if (timingfd < 0 || timing_seen & (1u << ph)) return ;
+  tain_now_g() ;
+  timing_phase[ph] = STAMP ;
+  timing_seen |= 1u << ph ;
+}
+
+static void timing_log (char const *reason)
+{
+  char buf[TIMESTAMP + 6 + PID_FMT + PHASE_N * (12 + UINT64_FMT) + 2 * (5 + UINT64_FMT) + 64] ;
+  size_t m = 0 ;
+  if (timingfd < 0) return ;
+  m += timestamp_fmt(buf + m, &timing_wallclock) ;
+  memcpy(buf + m, " pid=", 5) ; m += 5 ;
+  m += pid_fmt(buf + m, getpid()) ;
+  for (unsigned int i = 0 ; i < PHASE_N ; i++)
+  {
+    size_t n = strlen(phase_name[i]) ;
+    buf[m++] = ' ' ;
+    memcpy(buf + m, phase_name[i], n) ; m += n ;
+    buf[m++] = '=' ;
+    if (timing_seen & (1u << i))
+    {
+      tain d ;
+      tain_sub(&d, timing_phase + i, &timing_start) ;
+      m += uint64_fmt(buf + m, tai_sec(tain_secp(&d)) * 1000000 + d.nano / 1000) ;
+    }
+    else buf[m++] = '-' ;
+  }
+  memcpy(buf + m, " in=", 4) ; m += 4 ;
+  m += uint64_fmt(buf + m, bytes_in) ;
+  memcpy(buf + m, " out=", 5) ; m += 5 ;
+  m += uint64_fmt(buf + m, bytes_out) ;
+  memcpy(buf + m, " exit=", 6) ; m += 6 ;
+  {
+    size_t n = strlen(reason) ;
+    if (n > 32) n = 32 ;
+    memcpy(buf + m, reason, n) ; m += n ;
+  }
+  buf[m++] = '\n' ;
+  if (allwrite(timingfd, buf, m) < m)
+    strerr_warnwu1sys("write timing log") ;
+  timingfd = -1 ;
+}
+
 
-static cbfunc_ref cbq[MAXCBQ] ;
-static size_t cbq_head = 0, cbq_tail = 0 ;
+ /*
+   Flight recorder: the last reclines lines read from each side during
+   the dialogue, stored raw. They're only formatted and printed when
+   the session dies of something that looks like an interop problem.
+ */
 
-static void cbfunc_enqueue (cbfunc_ref f)
+#define RECMAX 1000
+
+typedef struct recline_s recline, *recline_ref ;
+struct recline_s
+{
+  uint32_t seq ;
+  uint32_t len ;
+  char s[INSIZE] ;
+} ;
+
+static unsigned int reclines = 0 ;
+static recline *rec[2] ;  /* client, server */
+static uint32_t reccount[2] = { 0, 0 } ;
+static uint32_t recseq = 0 ;
+
+static void rec_init (void)
 {
-  size_t newhead = (cbq_head + 1) % MAXCBQ ;
-  if (newhead == cbq_tail)
-    strerr_dief1x(101, "cbq full, increase MAXCBQ") ;
-  cbq[cbq_head] = f ;
-  cbq_head = newhead ;
+  for (unsigned int i = 0 ; i < 2 ; i++)
+  {
+    rec[i] = alloc(reclines * sizeof(recline)) ;
+    if (!rec[i]) strerr_diefu1sys(111, "alloc") ;
+  }
+}
+
+static inline void rec_line (unsigned int side, char const *s, size_t len)
+{
+  recline *r ;
+  if (!reclines) return ;
+  r = rec[side] + reccount[side]++ % reclines ;
+  r->seq = recseq++ ;
+  r->len = len ;
+  memcpy(r->s, s, len) ;
+}
+
+static void rec_dump (void)
+{
+  uint32_t i[2] ;
+  if (!reclines) return ;
+  for (unsigned int side = 0 ; side < 2 ; side++)
+    i[side] = reccount[side] > reclines ? reccount[side] - reclines : 0 ;
+  strerr_warni1x("last lines of the dialogue:") ;
+  while (i[0] < reccount[0] || i[1] < reccount[1])
+  {
+    unsigned int side = i[1] >= reccount[1] ? 0 : i[0] >= reccount[0] ? 1 :
+      rec[0][i[0] % reclines].seq > rec[1][i[1] % reclines].seq ;
+    recline const *r = rec[side] + i[side]++ % reclines ;
+    char buf[INSIZE] ;
+    size_t len = r->len ;
+    while (len && (r->s[len-1] == '\n' || r->s[len-1] == '\r')) len-- ;
+    for (size_t j = 0 ; j < len ; j++)
+      buf[j] = (unsigned char)r->s[j] < 32 || r->s[j] == 127 ? '?' : r->s[j] ;
+    buf[len] = 0 ;
+    strerr_warni2x(side ? "S: " : "C: ", buf) ;
+  }
+  reclines = 0 ;
+}
+
+
+ /*
+   The cbq is a fifo of what to do with the next server answers.
+   Entries with no f are answers we generated ourselves, but that
+   must wait until the server has answered previous commands if
+   the client pipelines.
+ */
+
+static genalloc cbq = GENALLOC_ZERO ;  /* cbentry */
+static size_t cbq_tail = 0 ;
+
+#define cbq_isempty() (cbq_tail == genalloc_len(cbentry, &cbq))
+#define cbq_peek() (genalloc_s(cbentry, &cbq) + cbq_tail)
+
+static void cbq_push (cbfunc_ref f, char const *answer)
+{
+  cbentry e = { .f = f, .answer = answer } ;
+  if (!genalloc_append(cbentry, &cbq, &e)) strerr_diefu1sys(111, "grow cbq") ;
+}
+
+static void cbq_pop (void)
+{
+  if (++cbq_tail == genalloc_len(cbentry, &cbq))
+  {
+    genalloc_setlen(cbentry, &cbq, 0) ;
+    cbq_tail = 0 ;
+  }
+}
+
+static void out_put (bufalloc *ba, char const *s, size_t len)
+{
+  if (bufalloc_len(ba) + len > OUTMAX)  /* unresponsive peer */
+  {
+    rec_dump() ;
+    _exit(1) ;
+  }
+  if (!bufalloc_put(ba, s, len)) strerr_diefu1sys(111, "grow output buffer") ;
+}
+
+
+ /*
+   Lines are read in place in the input buffers: we find the newline
+   with memchr in the ring, and NUL-terminate the line by overwriting
+   the byte after it, which we restore when the line is done. Only a
+   line that wraps around the ring, or ends on its last byte, is copied
+   to io.line. Nothing reads the rest of an input buffer while a line
+   is live, except out_move(), which restores the byte first.
+ */
+
+static char *linend = 0 ;
+static char linendc ;
+
+static void line_done (void)
+{
+  if (linend)
+  {
+    *linend = linendc ;
+    linend = 0 ;
+  }
+}
+
+static ssize_t line_get (io_t *p, char **line)
+{
+  for (;;)
+  {
+    struct iovec v[2] ;
+    char *nl = 0 ;
+    size_t len = 0 ;
+    buffer_rpeek(&p->in, v) ;
+    if (p->w < v[0].iov_len)
+    {
+      nl = memchr((char *)v[0].iov_base + p->w, '\n', v[0].iov_len - p->w) ;
+      if (nl) len = nl - (char *)v[0].iov_base + 1 ;
+    }
+    if (!nl)
+    {
+      size_t off = p->w > v[0].iov_len ? p->w - v[0].iov_len : 0 ;
+      if (off < v[1].iov_len)
+      {
+        nl = memchr((char *)v[1].iov_base + off, '\n', v[1].iov_len - off) ;
+        if (nl) len = v[0].iov_len + (nl - (char *)v[1].iov_base) + 1 ;
+      }
+    }
+    if (nl)
+    {
+      p->w = 0 ;
+      if (len <= v[0].iov_len && nl + 1 < p->inbuf + INSIZE)
+      {
+        linend = nl + 1 ;
+        linendc = *linend ;
+        *linend = 0 ;
+        *line = v[0].iov_base ;
+      }
+      else
+      {
+        size_t n = len < v[0].iov_len ? len : v[0].iov_len ;
+        memcpy(p->line, v[0].iov_base, n) ;
+        memcpy(p->line + n, v[1].iov_base, len - n) ;
+        p->line[len] = 0 ;
+        *line = p->line ;
+      }
+      buffer_rseek(&p->in, len) ;
+      return len ;
+    }
+    p->w = v[0].iov_len + v[1].iov_len ;
+    if (p->w >= INSIZE - 1) return (errno = ERANGE, -1) ;
+    {
+      ssize_t r = buffer_fill(&p->in) ;
+      if (r <= 0) return r ;
+    }
+  }
+}
+
+static void out_move (bufalloc *ba, buffer *b)
+{
+  size_t n ;
+  line_done() ;
+  n = buffer_len(b) ;
+  if (n)
+  {
+    struct iovec v[2] ;
+    buffer_rpeek(b, v) ;
+    out_put(ba, v[0].iov_base, v[0].iov_len) ;
+    out_put(ba, v[1].iov_base, v[1].iov_len) ;
+    buffer_rseek(b, n) ;
+  }
+}
+
+ /* hysteresis: is reading from the peer that fills ba paused? */
+static int out_full (bufalloc const *ba, int paused)
+{
+  return bufalloc_len(ba) >= (paused ? OUTLOW : OUTHIGH) ;
 }
 
 static inline void answer_enqueue (char const *s)
 {
-  if (buffer_puts(&io[0].out, s) < 0) _exit(1) ;  /* unresponsive client */
+  out_put(&io[0].out, s, strlen(s)) ;
+}
+
+static void answer_local (char const *s)
+{
+  if (cbq_isempty()) answer_enqueue(s) ;
+  else cbq_push(0, s) ;
 }
 
 static int answer_forward (char const *s)
@@ -87,21 +496,135 @@ static int answer_forward (char const *s)
   return 1 ;
 }
 
-static int answer_ehlo (char const *s)
+
+ /*
+   The EHLO cache is a file containing the last successful EHLO answer
+   we sent, with our own capabilities added. If it is recent enough,
+   we answer EHLO from it without bothering the server. That only
+   works with servers whose EHLO answer does not depend on the client,
+   such as qmail-smtpd.
+ */
+
+static char const *ehlocache_get (void)
 {
-  static int needed = 1 ;
-  if (needed && s[0] == '2' && !strncasecmp(s+4, "starttls", 8))
+  static stralloc sa = STRALLOC_ZERO ;
+  struct stat st ;
+  char buf[OUTSIZE] ;
+  ssize_t r ;
+  if (!ehlocache) return 0 ;
+  if (sa.len) return sa.s ;
+  if (stat(ehlocache, &st) == -1)
   {
-    needed = 0 ;
-    strerr_warni1x("server seems to support STARTTLS natively") ;
+    if (errno != ENOENT) strerr_warnwu2sys("stat ", ehlocache) ;
+    return 0 ;
   }
-  if (needed && s[3] == ' ') answer_enqueue("250-STARTTLS\r\n") ;
-  answer_enqueue(s) ;
+  if (st.st_mtime + (time_t)ehlottl <= time(0)) return 0 ;
+  r = openreadnclose(ehlocache, buf, OUTSIZE) ;
+  if (r == -1)
+  {
+    if (errno != ENOENT) strerr_warnwu2sys("read ", ehlocache) ;
+    return 0 ;
+  }
+  if (r < 6 || r >= OUTSIZE || buf[r-1] != '\n') return 0 ;
+  if (!stralloc_catb(&sa, buf, r) || !stralloc_0(&sa))
+    strerr_diefu1sys(111, "stralloc_catb") ;
+  return sa.s ;
+}
+
+static void ehlocache_store (char const *s, size_t len)
+{
+  size_t n = strlen(ehlocache) ;
+  int fd ;
+  char tmp[n + 8] ;
+  memcpy(tmp, ehlocache, n) ;
+  memcpy(tmp + n, ":XXXXXX", 8) ;
+  fd = mkstemp(tmp) ;
+  if (fd == -1) goto err ;
+  if (allwrite(fd, s, len) < len)
+  {
+    fd_close(fd) ;
+    goto errunlink ;
+  }
+  fd_close(fd) ;
+  if (rename(tmp, ehlocache) == -1) goto errunlink ;
+  return ;
+
+ errunlink:
+  unlink_void(tmp) ;
+ err:
+  strerr_warnwu2sys("write ", ehlocache) ;
+}
+
+ /* a write and a rename per session is too much: only when it changes */
+static void ehlocache_update (char const *s, size_t len)
+{
+  char const *cached = ehlocache_get() ;
+  if (cached && strlen(cached) == len && !memcmp(cached, s, len)) return ;
+  ehlocache_store(s, len) ;
+}
+
+static int ehlo_collect (char const *s)
+{
+  static int needtls = 1 ;
+  if (s[0] == '2')
+  {
+    if (needtls && !strncasecmp(s+4, "starttls", 8))
+    {
+      needtls = 0 ;
+      stats_inc(native) ;
+      strerr_warni1x("server seems to support STARTTLS natively") ;
+    }
+    if (s[3] == ' ' && needtls && !stralloc_cats(&ehlosa, "250-STARTTLS\r\n")) goto err ;
+  }
+  if (!stralloc_cats(&ehlosa, s)) goto err ;
+  if (s[3] != ' ') return 0 ;
+  if (s[0] == '2' && ehlocache) ehlocache_update(ehlosa.s, ehlosa.len) ;
+  if (!stralloc_0(&ehlosa)) goto err ;
+  return 1 ;
+
+ err:
+  strerr_diefu1sys(111, "stralloc_catb") ;
+}
+
+static int answer_ehlo (char const *s)
+{
+  if (!ehlo_collect(s)) return 0 ;
+  answer_enqueue(ehlosa.s) ;
+  ehlosa.len = 0 ;
+  return 1 ;
+}
+
+static void ehlo_refused (void) gccattr_noreturn ;
+static void ehlo_refused (void)
+{
+  rec_dump() ;
+  timing_log("ehlofail") ;
+  answer_enqueue("421 Service not available, closing transmission channel\r\n") ;
+  bufalloc_timed_flush_g(&io[0].out, &deadline) ;
+  strerr_dief1x(100, "server refused the replayed EHLO") ;
+}
+
+ /*
+   The client was told its EHLO succeeded. If the server says
+   otherwise, the session can't go on as the client believes it does.
+ */
+
+static int answer_ehlo_replay (char const *s)
+{
+  if (!ehlo_collect(s)) return 0 ;
+  ehlosa.len = 0 ;
+  if (s[0] != '2') ehlo_refused() ;
+  return 1 ;
+}
+
+static int answer_discard (char const *s)
+{
   return s[3] == ' ' ;
 }
 
 static int trigger_starttls (char const *s)
 {
+  if (s[3] != ' ') return 0 ;
   if (s[0] != '2')
   {
     answer_enqueue("454 Server failed to reset\r\n") ;
@@ -117,170 +640,610 @@ static void process_server_line (char const *s)
    || s[1] < '0' || s[1] > '9'
    || s[2] < '0' || s[2] > '9'
    || (s[3] != ' ' && s[3] != '-'))
+  {
+    rec_dump() ;
     strerr_dief1x(100, "server is not speaking SMTP") ;
-  if (cbq_head == cbq_tail)
+  }
+  phase_mark(PHASE_BANNER) ;
+  bannerwait = 0 ;
+  if (cbq_isempty())
+  {
+    rec_dump() ;
     strerr_dief1x(101, "can't happen: popping an empty cbq!") ;
-  if ((*cbq[cbq_tail])(s)) cbq_tail = (cbq_tail + 1) % MAXCBQ ;
+  }
+  if ((*cbq_peek()->f)(s))
+  {
+    cbq_pop() ;
+    while (!cbq_isempty() && !cbq_peek()->f)
+    {
+      answer_enqueue(cbq_peek()->answer) ;
+      cbq_pop() ;
+    }
+  }
 }
 
-static int namecmp (void const *a, void const *b)
+static int command_enqueue (char const *s, cbfunc_ref f)
 {
-  char const *key = a ;
-  char const *name = ((struct cmdmap_s const *)b)->name ;
-  size_t len = strlen(name) ;
-  int r = strncasecmp(key, name, len) ;
-  if (r) return r ;
-  return !(key[len] == ' ' || key[len] == '\r' || key[len] == '\n') ;
+  out_put(&io[1].out, s, strlen(s)) ;
+  cbq_push(f, 0) ;
+  return 0 ;
 }
-#define BSEARCH(key, array) bsearch(key, (array), sizeof(array)/sizeof(struct cmdmap_s), sizeof(struct cmdmap_s), &namecmp)
 
-static int command_enqueue (char const *s, cbfunc_ref f)
+static void backend_init (int fdr, int fdw)
 {
-  if (buffer_puts(&io[1].out, s) < 0) _exit(1) ;  /* unresponsive server */
-  cbfunc_enqueue(f) ;
-  return 0 ;
+  if (ndelay_on(fdr) == -1 || ndelay_on(fdw) == -1)
+    strerr_diefu1sys(111, "make fds non-blocking") ;
+  buffer_init(&io[1].in, &buffer_read, fdr, io[1].inbuf, INSIZE) ;
+  bufalloc_init(&io[1].out, &fd_write, fdw) ;
+  backend = 1 ;
+}
+
+static void backend_connect (void)
+{
+  static char const *const vars[4] = { "TCPREMOTEIP", "TCPLOCALIP", "TCPREMOTEPORT", "TCPLOCALPORT" } ;
+  char const *x[4] ;
+  tain dl ;
+  int fdw ;
+  int fd = ipc_stream_nbcoe() ;
+  if (fd == -1) strerr_diefu1sys(111, "create socket") ;
+  tain_add_g(&dl, &tain_infinite_relative) ;
+  if (timeout_banner) tain_addsec_g(&dl, timeout_banner) ;
+  if (!ipc_timed_connect_g(fd, backend_socket, &dl))
+    strerr_diefu2sys(111, "connect to ", backend_socket) ;
+  fdw = dup(fd) ;
+  if (fdw == -1 || coe(fdw) == -1) strerr_diefu1sys(111, "dup socket") ;
+  backend_init(fd, fdw) ;
+
+ /*
+   The server doesn't get our environment, so it gets a PROXY
+   protocol v1 header instead, before anything else.
+ */
+
+  for (unsigned int i = 0 ; i < 4 ; i++) x[i] = getenv(vars[i]) ;
+  if (x[0] && x[1] && x[2] && x[3])
+  {
+    int ip6 = !!strchr(x[0], ':') ;
+    out_put(&io[1].out, ip6 ? "PROXY TCP6 " : "PROXY TCP4 ", 11) ;
+    for (unsigned int i = 0 ; i < 4 ; i++)
+    {
+      out_put(&io[1].out, x[i], strlen(x[i])) ;
+      out_put(&io[1].out, i < 3 ? " " : "\r\n", i < 3 ? 1 : 2) ;
+    }
+  }
+  else out_put(&io[1].out, "PROXY UNKNOWN\r\n", 15) ;
+}
+
+static void backend_spawn (cbfunc_ref onbanner)
+{
+  int p[2][2] ;
+  cspawn_fileaction fa[2] =
+  {
+    { .type = CSPAWN_FA_MOVE, .x = { .fd2 = { [0] = 0 } } },
+    { .type = CSPAWN_FA_MOVE, .x = { .fd2 = { [0] = 1 } } }
+  } ;
+  if (backend_socket) backend_connect() ;
+  else
+  {
+    if (pipecoe(p[0]) == -1 || pipecoe(p[1]) == -1)
+      strerr_diefu1sys(111, "pipe") ;
+    fa[0].x.fd2[1] = p[1][0] ;
+    fa[1].x.fd2[1] = p[0][1] ;
+    backendpid = mspawn_m(backend_argv, 0, 0, 0, fa, 2) ;
+    if (!backendpid) strerr_diefu2sys(111, "spawn ", backend_argv[0]) ;
+    fd_close(p[1][0]) ;
+    fd_close(p[0][1]) ;
+    backend_init(p[0][0], p[1][1]) ;
+  }
+  banner_arm() ;
+  cbq_push(onbanner, 0) ;
+}
+
+ /*
+   Only called once the server has closed its output, so it is exiting
+   or about to: wait for it, and say so if it didn't exit cleanly.
+ */
+
+static void backend_reap (void)
+{
+  char fmt[UINT_FMT] ;
+  int wstat ;
+  if (!backendpid) return ;
+  if (wait_pid(backendpid, &wstat) == -1)
+  {
+    strerr_warnwu2sys("wait for ", backend_argv[0]) ;
+    return ;
+  }
+  backendpid = 0 ;
+  if (WIFSIGNALED(wstat))
+  {
+    fmt[uint_fmt(fmt, WTERMSIG(wstat))] = 0 ;
+    strerr_warnw3x(backend_argv[0], " crashed with signal ", fmt) ;
+  }
+  else if (WEXITSTATUS(wstat))
+  {
+    fmt[uint_fmt(fmt, WEXITSTATUS(wstat))] = 0 ;
+    strerr_warnw3x(backend_argv[0], " exited ", fmt) ;
+  }
+}
+
+ /*
+   The client may have seen our banner and our EHLO answer instead of
+   the server's. Before the server is needed: eat its banner, and
+   replay the client's EHLO, so it sees the same session as the client.
+ */
+
+static void backend_need (void)
+{
+  if (!backend) backend_spawn(&answer_discard) ;
+  if (ehlopending)
+  {
+    command_enqueue(ehloline, &answer_ehlo_replay) ;
+    ehlopending = 0 ;
+  }
 }
 
 static int do_noop (char const *s)
 {
   (void)s ;
-  answer_enqueue("250 OK\r\n") ;
+  answer_local("250 OK\r\n") ;
   return 0 ;
 }
 
 static int do_forward (char const *s)
 {
+  backend_need() ;
   return command_enqueue(s, &answer_forward) ;
 }
 
+static int do_help (char const *s)
+{
+  if (backend) return do_forward(s) ;
+  answer_local("214 https://skarnet.org/software/smtpd-starttls-proxy/\r\n") ;
+  return 0 ;
+}
+
+static int do_rset (char const *s)
+{
+  return backend ? do_forward(s) : do_noop(s) ;
+}
+
+static int do_quit (char const *s)
+{
+  if (backend) return do_forward(s) ;
+  answer_local(lazyquit) ;
+  backend = -1 ;
+  return 1 ;
+}
+
 static int do_badorder (char const *s)
 {
   (void)s ;
-  answer_enqueue("503 MAIL first. Are you like this with girls too?\r\n") ;
+  answer_local("503 MAIL first. Are you like this with girls too?\r\n") ;
   return 0 ;
 }
 
 static int do_ehlo (char const *s)
 {
-  return command_enqueue(s, &answer_ehlo) ;
+  char const *cached = ehlocache_get() ;
+  phase_mark(PHASE_EHLO) ;
+  if (backend && !cached)
+  {
+    ehlopending = 0 ;
+    return command_enqueue(s, &answer_ehlo) ;
+  }
+  memcpy(ehloline, s, strlen(s) + 1) ;
+  ehlopending = 1 ;
+  answer_local(cached ? cached : lazyehlo) ;
+  return 0 ;
+}
+
+static void server_passthrough (void)
+{
+  out_move(&io[0].out, &io[1].in) ;
 }
 
 static int do_notls (char const *s)
 {
-  size_t n = buffer_len(&io[0].in) ;
-  if (buffer_puts(&io[1].out, s) < 0) _exit(1) ;
+  bytes_in += buffer_len(&io[0].in) ;
+  backend_need() ;
+  out_put(&io[1].out, s, strlen(s)) ;
   fd_close(fdctl) ;
   fd_close(sslfds[1]) ;
   fd_close(sslfds[0]) ;
-  if (n)
-  {
-    struct iovec v[2] ;
-    buffer_rpeek(&io[0].in, v) ;
-    if (buffer_putv(&io[1].out, v, 2) < 0) _exit(1) ;
-    buffer_rseek(&io[0].in, n) ;
-  }
-  n = buffer_len(&io[1].in) ;
-  if (n)
-  {
-    struct iovec v[2] ;
-    buffer_rpeek(&io[1].in, v) ;
-    if (buffer_putv(&io[0].out, v, 2) < 0) _exit(1) ;
-    buffer_rseek(&io[1].in, n) ;
-  }
+  out_move(&io[1].out, &io[0].in) ;
+  stats_inc(notls) ;
+  if (cbq_isempty()) server_passthrough() ;  /* else, when pipelined answers are done */
   wantexec = 1 ;
   return 1 ;
 }
 
 static int do_starttls (char const *s)
 {
+  (void)s ;
   if (buffer_len(&io[0].in))
-    answer_enqueue("503 After STARTTLS you need to stfu\r\n") ;
+    answer_local("503 After STARTTLS you need to stfu\r\n") ;
   else
   {
-    command_enqueue("RSET\r\n", &trigger_starttls) ;
+    phase_mark(PHASE_STARTTLS) ;
+    if (!backend) backend_spawn(&trigger_starttls) ;  /* fresh server, its banner is enough */
+    else answer_local("220 Ready to start TLS\r\n") ;  /* no transaction to reset: MAIL goes to do_notls */
     wantexec = 2 ;
   }
   return 0 ;
 }
 
+
+static cmdfunc_ref const verbfunc[SSTPVERB_N] =
+{
+  [SSTPVERB_DATA] = &do_badorder,
+  [SSTPVERB_EHLO] = &do_ehlo,
+  [SSTPVERB_EXPN] = &do_forward,
+  [SSTPVERB_HELO] = &do_notls,
+  [SSTPVERB_HELP] = &do_help,
+  [SSTPVERB_MAIL] = &do_notls,
+  [SSTPVERB_NOOP] = &do_noop,
+  [SSTPVERB_QUIT] = &do_quit,
+  [SSTPVERB_RCPT] = &do_badorder,
+  [SSTPVERB_RSET] = &do_rset,
+  [SSTPVERB_STARTTLS] = &do_starttls,
+  [SSTPVERB_VRFY] = &do_forward
+} ;
+
 static int process_client_line (char const *s)
 {
-  static struct cmdmap_s const commands[] =
-  {
-    { .name = "data", .f = &do_badorder },
-    { .name = "ehlo", .f = &do_ehlo },
-    { .name = "expn", .f = &do_forward },
-    { .name = "helo", .f = &do_notls },
-    { .name = "help", .f = &do_forward },
-    { .name = "mail", .f = &do_notls },
-    { .name = "noop", .f = &do_noop },
-    { .name = "quit", .f = &do_forward },
-    { .name = "rcpt", .f = &do_badorder },
-    { .name = "rset", .f = &do_forward },
-    { .name = "starttls", .f = &do_starttls },
-    { .name = "vrfy", .f = &do_forward }
-  } ;
-  struct cmdmap_s const *cmd = BSEARCH(s, commands) ;
-  if (cmd) return (*cmd->f)(s) ;
-  answer_enqueue("500 SMTP motherfucker, do you speak it?\r\n") ;
+  cmdfunc_ref f = verbfunc[sstpverb(s)] ;
+  if (f) return (*f)(s) ;
+  answer_local("500 SMTP motherfucker, do you speak it?\r\n") ;
   return 0 ;
 }
 
 
  /* Engine */
 
-static void child (int, int) gccattr_noreturn ;
-static void child (int fdr, int fdw)
+static void ioconnect (int, int) gccattr_noreturn ;
+static void ioconnect (int fdr, int fdw)
 {
-  iopause_fd x[4] = { { .fd = 0 }, { .fd = 1 }, { .fd = fdr }, { .fd = fdw } } ;
-  tain deadline ;
-  PROG = "smtpd-starttls-proxy-io" ;
+  char fmtr[UINT_FMT] ;
+  char fmtw[UINT_FMT] ;
+  char const *newargv[6] = { S6_EXTBINPREFIX "s6-ioconnect", "-r", fmtr, "-w", fmtw, 0 } ;
+  timing_log(wantexec >= 2 ? "tls" : "notls") ;  /* the relay is not ours to measure */
+  fmtr[uint_fmt(fmtr, fdr)] = 0 ;
+  fmtw[uint_fmt(fmtw, fdw)] = 0 ;
+  if (uncoe(fdr) == -1 || uncoe(fdw) == -1) strerr_diefu1sys(111, "uncoe") ;  /* our server fds are all close-on-exec */
+  xexec(newargv) ;
+}
+
+#ifdef SKALIBS_HASSPLICE
+
+ /*
+   Replaces s6-ioconnect after the dialogue. The server side is
+   normally a pair of pipes, so every direction has a pipe at one end
+   at least: data can go straight from one fd to the other with
+   splice() and never enter our address space. Saves an exec and a
+   copy per byte. With -u, the server side is a socket, and if the
+   client side is one too, splice() can't help: s6-ioconnect it is.
+ */
+
+static int ispipe (int fd)
+{
+  struct stat st ;
+  return !fstat(fd, &st) && S_ISFIFO(st.st_mode) ;
+}
+
+static void relay_close (int from, int to)
+{
+  fd_close(from) ;
+  fd_shutdown(to, 1) ;
+  fd_close(to) ;
+}
+
+#ifdef USE_IO_URING
+
+ /*
+   Same thing with io_uring: one splice SQE in flight per direction,
+   and a single syscall per batch of completions instead of a poll
+   plus a splice per chunk. No liburing, the rings are simple enough.
+   If the kernel can't do it, we return and the poll engine takes over.
+ */
+
+typedef struct uring_s uring, *uring_ref ;
+struct uring_s
+{
+  int fd ;
+  unsigned int tosubmit ;
+  unsigned int *sqtail ;
+  unsigned int const *sqmask ;
+  unsigned int *sqarray ;
+  struct io_uring_sqe *sqes ;
+  unsigned int *cqhead ;
+  unsigned int const *cqtail ;
+  unsigned int const *cqmask ;
+  struct io_uring_cqe const *cqes ;
+} ;
+
+static int uring_init (uring *u)
+{
+  struct io_uring_params p ;
+  uint64_t probebuf[(sizeof(struct io_uring_probe) + (IORING_OP_SPLICE + 1) * sizeof(struct io_uring_probe_op) + 7) >> 3] ;
+  struct io_uring_probe *probe = (struct io_uring_probe *)probebuf ;
+  char *ring ;
+  size_t n ;
+  memset(&p, 0, sizeof p) ;
+  u->fd = syscall(__NR_io_uring_setup, 4, &p) ;
+  if (u->fd == -1) return 0 ;
+  memset(probebuf, 0, sizeof(probebuf)) ;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP)
+   || syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PROBE, probe, IORING_OP_SPLICE + 1) == -1
+   || probe->last_op < IORING_OP_SPLICE
+   || !(probe->ops[IORING_OP_SPLICE].flags & IO_URING_OP_SUPPORTED)) goto err ;
+  n = p.sq_off.array + p.sq_entries * sizeof(unsigned int) ;
+  if (n < p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe))
+    n = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) ;
+  ring = mmap(0, n, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING) ;
+  if (ring == MAP_FAILED) goto err ;
+  u->sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES) ;
+  if (u->sqes == MAP_FAILED) goto errunmap ;
+  u->tosubmit = 0 ;
+  u->sqtail = (unsigned int *)(ring + p.sq_off.tail) ;
+  u->sqmask = (unsigned int const *)(ring + p.sq_off.ring_mask) ;
+  u->sqarray = (unsigned int *)(ring + p.sq_off.array) ;
+  u->cqhead = (unsigned int *)(ring + p.cq_off.head) ;
+  u->cqtail = (unsigned int const *)(ring + p.cq_off.tail) ;
+  u->cqmask = (unsigned int const *)(ring + p.cq_off.ring_mask) ;
+  u->cqes = (struct io_uring_cqe const *)(ring + p.cq_off.cqes) ;
+  return 1 ;
 
-  if (ndelay_on(0) == -1 || ndelay_on(1) == -1 || ndelay_on(fdr) == -1 || ndelay_on(fdw) == -1)
+ errunmap:
+  munmap(ring, n) ;
+ err:
+  fd_close(u->fd) ;
+  return 0 ;
+}
+
+static void uring_splice (uring *u, int fdin, int fdout, unsigned int i)
+{
+  unsigned int tail = *u->sqtail ;
+  unsigned int j = tail & *u->sqmask ;
+  struct io_uring_sqe *sqe = u->sqes + j ;
+  memset(sqe, 0, sizeof(struct io_uring_sqe)) ;
+  sqe->opcode = IORING_OP_SPLICE ;
+  sqe->fd = fdout ;
+  sqe->off = (uint64_t)-1 ;
+  sqe->splice_off_in = (uint64_t)-1 ;
+  sqe->splice_fd_in = fdin ;
+  sqe->len = SPLICE_CHUNK ;
+  sqe->splice_flags = SPLICE_F_MOVE ;
+  sqe->user_data = i ;
+  u->sqarray[j] = j ;
+  __atomic_store_n(u->sqtail, tail + 1, __ATOMIC_RELEASE) ;
+  u->tosubmit++ ;
+}
+
+static void relay_uring (int fdr, int fdw)
+{
+  uring u ;
+  int fds[2][2] = { { 0, fdw }, { fdr, 1 } } ;
+  if (!uring_init(&u)) return ;
+
+ /* the work is done by kernel threads that can block: no O_NONBLOCK */
+  if (ndelay_off(fdr) == -1 || ndelay_off(fdw) == -1)
+    strerr_diefu1sys(111, "make fds blocking") ;
+  uring_splice(&u, fds[0][0], fds[0][1], 0) ;
+  uring_splice(&u, fds[1][0], fds[1][1], 1) ;
+
+  while (fds[0][0] >= 0 || fds[1][0] >= 0)
+  {
+    unsigned int head = *u.cqhead ;
+    if (syscall(__NR_io_uring_enter, u.fd, u.tosubmit, 1, IORING_ENTER_GETEVENTS, 0, 0) == -1)
+    {
+      if (errno == EINTR) continue ;
+      strerr_diefu1sys(111, "io_uring_enter") ;
+    }
+    u.tosubmit = 0 ;
+    while (head != __atomic_load_n(u.cqtail, __ATOMIC_ACQUIRE))
+    {
+      struct io_uring_cqe const *cqe = u.cqes + (head++ & *u.cqmask) ;
+      unsigned int i = cqe->user_data ;
+      int r = cqe->res ;
+      if (r == -EINTR || r == -EAGAIN) r = -1 ;
+      else if (r == -EPIPE) r = 0 ;  /* nobody to read it, same as EOF */
+      else if (r < 0)
+      {
+        errno = -r ;
+        strerr_diefu1sys(111, i ? "relay data to client" : "relay data to server") ;
+      }
+      if (r > 0) *(i ? &bytes_out : &bytes_in) += r ;
+      if (r) uring_splice(&u, fds[i][0], fds[i][1], i) ;
+      else
+      {
+        relay_close(fds[i][0], fds[i][1]) ;
+        fds[i][0] = fds[i][1] = -1 ;
+      }
+    }
+    __atomic_store_n(u.cqhead, head, __ATOMIC_RELEASE) ;
+  }
+  timing_log(wantexec >= 2 ? "tls" : "notls") ;
+  backend_reap() ;
+  _exit(0) ;
+}
+
+#endif
+
+ /*
+   Each direction waits for its source to be readable, and only for
+   its destination to be writable after a splice() would have blocked,
+   until the next one goes through. A splice() can also block for lack
+   of data, so if the destination says it's writable and the splice()
+   still blocks, the source is empty and we go back to waiting on it.
+ */
+
+static void relay (int, int) gccattr_noreturn ;
+static void relay (int fdr, int fdw)
+{
+  iopause_fd x[4] = { { .fd = 0 }, { .fd = fdw }, { .fd = fdr }, { .fd = 1 } } ;
+  int blocked[2] = { 0, 0 } ;
+
+  if (backend_socket && (!ispipe(0) || !ispipe(1))) ioconnect(fdr, fdw) ;
+  if (sig_altignore(SIGPIPE) == -1)
+    strerr_diefu1sys(111, "ignore SIGPIPE") ;
+#ifdef USE_IO_URING
+  relay_uring(fdr, fdw) ;
+#endif
+  if (ndelay_on(0) == -1 || ndelay_on(1) == -1)
     strerr_diefu1sys(111, "make fds non-blocking") ;
-  buffer_init(&io[1].in, &buffer_read, fdr, io[1].inbuf, INSIZE) ;
-  buffer_init(&io[1].out, &buffer_write, fdw, io[1].outbuf, OUTSIZE) ;
+
+  while (x[0].fd >= 0 || x[2].fd >= 0)
+  {
+    for (unsigned int i = 0 ; i < 4 ; i += 2)
+    {
+      x[i].events = x[i].fd >= 0 && !blocked[i>>1] ? IOPAUSE_READ : 0 ;
+      x[i+1].events = x[i].fd >= 0 && blocked[i>>1] ? IOPAUSE_WRITE : 0 ;
+    }
+    if (iopause_g(x, 4, 0) == -1) strerr_diefu1sys(111, "iopause") ;
+    for (unsigned int i = 0 ; i < 4 ; i++) if (x[i].revents & IOPAUSE_EXCEPT) x[i].revents |= IOPAUSE_READ | IOPAUSE_WRITE ;
+
+    for (unsigned int i = 0 ; i < 4 ; i += 2)
+    {
+      ssize_t r ;
+      if (x[i].fd == -1 || !(blocked[i>>1] ? x[i+1].revents & IOPAUSE_WRITE : x[i].revents & IOPAUSE_READ)) continue ;
+      r = splice(x[i].fd, 0, x[i+1].fd, 0, SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK) ;
+      if (r == -1)
+      {
+        if (error_isagain(errno))
+        {
+          blocked[i>>1] = !blocked[i>>1] ;
+          continue ;
+        }
+        if (errno != EPIPE) strerr_diefu1sys(111, i ? "relay data to client" : "relay data to server") ;
+        r = 0 ;  /* nobody to read it, same as EOF */
+      }
+      if (i) bytes_out += r ; else bytes_in += r ;
+      blocked[i>>1] = 0 ;
+      if (!r)
+      {
+        relay_close(x[i].fd, x[i+1].fd) ;
+        x[i].fd = x[i+1].fd = -1 ;
+      }
+    }
+  }
+  timing_log(wantexec >= 2 ? "tls" : "notls") ;
+  backend_reap() ;
+  _exit(0) ;
+}
+
+#endif
+
+static void timedout (char const *, char const *) gccattr_noreturn ;
+static void timedout (char const *reason, char const *what)
+{
+  rec_dump() ;
+  timing_log(reason) ;
+  stats_inc(timeouts) ;
+  strerr_dief2x(99, "timed out waiting for ", what) ;
+}
+
+static void flow_update (void)
+{
+  io[0].paused = out_full(&io[0].out, io[0].paused) || out_full(&io[1].out, io[0].paused) ;
+  io[1].paused = out_full(&io[0].out, io[1].paused) ;
+}
+
+static inline int want_client (void)
+{
+  return !wantexec && backend >= 0 && !io[0].paused ;
+}
+
+static inline int want_server (void)
+{
+  return backend > 0 && (wantexec != 1 || !cbq_isempty()) && !io[1].paused ;
+}
+
+ /* the command timeout only runs while we owe the client nothing */
+static inline int client_turn (void)
+{
+  return cbq_isempty() && !bufalloc_len(&io[0].out) ;
+}
+
+static void proxy (void) gccattr_noreturn ;
+static void proxy (void)
+{
+  iopause_fd x[4] = { { .fd = 0 }, { .fd = 1 }, { .fd = -1 }, { .fd = -1 } } ;
+  int wasturn = 0 ;
+
+  if (ndelay_on(0) == -1 || ndelay_on(1) == -1)
+    strerr_diefu1sys(111, "make fds non-blocking") ;
+  bufalloc_init(&io[0].out, &fd_write, 1) ;
   tain_now_set_stopwatch_g() ;
+  timing_init() ;
+  stats_inc(sessions) ;
   reset_timeout() ;
+  reset_command_timeout() ;
 
-  cbfunc_enqueue(&answer_forward) ;
+  if (lazybanner) answer_enqueue(lazybanner) ;
+  else backend_spawn(&answer_forward) ;
 
   for (;;)
   {
-    int r ;
-    if (!buffer_len(&io[0].out) && (x[2].fd == -1 || (cbq_head == cbq_tail && wantexec))) break ;
-    x[0].events = !wantexec ? IOPAUSE_READ : 0 ;
-    x[1].events = buffer_len(&io[0].out) ? IOPAUSE_WRITE : 0 ;
-    x[2].events = wantexec != 1 ? IOPAUSE_READ : 0 ;
-    x[3].events = buffer_len(&io[1].out) ? IOPAUSE_WRITE : 0 ;
-    r = iopause_g(x, 4, &deadline) ;
+    tain d = deadline ;
+    int r, turn ;
+    if (!bufalloc_len(&io[0].out) && (backend < 0 || (cbq_isempty() && wantexec))) break ;
+    turn = client_turn() ;
+    if (turn && !wasturn) reset_command_timeout() ;  /* the ball is in the client's court now */
+    wasturn = turn ;
+    flow_update() ;
+    x[0].events = want_client() ? IOPAUSE_READ : 0 ;
+    x[1].events = bufalloc_len(&io[0].out) ? IOPAUSE_WRITE : 0 ;
+    x[2].fd = backend > 0 ? buffer_fd(&io[1].in) : -1 ;
+    x[3].fd = backend > 0 ? bufalloc_fd(&io[1].out) : -1 ;
+    x[2].events = want_server() ? IOPAUSE_READ : 0 ;
+    x[3].events = bufalloc_len(&io[1].out) ? IOPAUSE_WRITE : 0 ;
+    if (bannerwait) tain_earliest1(&d, &deadline_banner) ;
+    if (x[0].events && turn) tain_earliest1(&d, &deadline_command) ;
+    r = iopause_g(x, 4, &d) ;
     if (r == -1) strerr_diefu1sys(111, "iopause") ;
-    if (!r) strerr_dief1x(99, "timed out") ;
+    if (!r)
+    {
+      if (bannerwait && !tain_less(&STAMP, &deadline_banner))
+        timedout("bannertimeout", "server banner") ;
+      if (x[0].events && turn && !tain_less(&STAMP, &deadline_command))
+        timedout("commandtimeout", "client command") ;
+      timedout("timeout", "activity") ;
+    }
     for (size_t i = 0 ; i < 4 ; i++) if (x[i].revents & IOPAUSE_EXCEPT) x[i].revents |= IOPAUSE_READ | IOPAUSE_WRITE ;
 
     if (x[1].events & x[1].revents & IOPAUSE_WRITE)
     {
-      if (!buffer_flush(&io[0].out))
+      size_t n = bufalloc_len(&io[0].out) ;
+      int ok = bufalloc_flush(&io[0].out) ;
+      bytes_out += n - bufalloc_len(&io[0].out) ;
+      if (!ok)
       {
-        if (error_isagain(errno)) strerr_diefu1sys(111, "write to client") ;
+        if (!error_isagain(errno)) strerr_diefu1sys(111, "write to client") ;
       }
       else reset_timeout() ;
     }
 
     if (x[3].events & x[3].revents & IOPAUSE_WRITE)
     {
-      if (!buffer_flush(&io[1].out))
+      if (!bufalloc_flush(&io[1].out))
       {
         if (!error_isagain(errno)) strerr_diefu1sys(111, "write to server") ;
       }
       else reset_timeout() ;
     }
 
-    if (x[2].revents & IOPAUSE_READ)
+   /*
+     Lines may be left in the input buffers when reading was paused:
+     process them as soon as we resume, the fd won't tell us.
+   */
+
+    flow_update() ;
+    if (want_server() && (x[2].revents & IOPAUSE_READ || buffer_len(&io[1].in)))
     {
       for (;;)
       {
-        int r = getlnmax(&io[1].in, io[1].line, INSIZE - 1, &io[1].w, '\n') ;
+        char *line ;
+        ssize_t r = line_get(&io[1], &line) ;
         if (r < 0)
         {
           if (error_isagain(errno)) break ;
@@ -288,89 +1251,171 @@ static void child (int fdr, int fdw)
         }
         if (!r)
         {
-          x[3].fd = -1 ;
-          x[2].fd = -1 ;
+          backend = -1 ;
           wantexec = 0 ;
           break ;
         }
-        io[1].line[io[1].w] = 0 ;
+        rec_line(1, line, r) ;
         reset_timeout() ;
-        process_server_line(io[1].line) ;
-        io[1].w = 0 ;
+        process_server_line(line) ;
+        line_done() ;
+        if (wantexec == 1 && cbq_isempty())
+        {
+          server_passthrough() ;
+          break ;
+        }
+        flow_update() ;
+        if (io[1].paused) break ;
       }
     }
 
-    if (x[0].revents & IOPAUSE_READ)
+    if (want_client() && (x[0].revents & IOPAUSE_READ || buffer_len(&io[0].in)))
     {
       for (;;)
       {
-        int r = getlnmax(&io[0].in, io[0].line, INSIZE - 1, &io[0].w, '\n') ;
+        char *line ;
+        ssize_t r = line_get(&io[0], &line) ;
         if (r < 0)
         {
           if (error_isagain(errno)) break ;
-          else if (errno == ERANGE) _exit(1) ;  /* DoS attempt, just gtfo */
+          else if (errno == ERANGE)  /* DoS attempt, just gtfo */
+          {
+            timing_log("dos") ;
+            _exit(1) ;
+          }
           else strerr_diefu1sys(111, "read line from client") ;
         }
-        if (!r) _exit(0) ;
-        io[0].line[io[0].w] = 0 ;
+        if (!r)
+        {
+          timing_log("eof") ;
+          _exit(0) ;
+        }
+        bytes_in += r ;
+        rec_line(0, line, r) ;
         reset_timeout() ;
-        if (process_client_line(io[0].line)) break ;
-        io[0].w = 0 ;
+        reset_command_timeout() ;
+        r = process_client_line(line) ;
+        line_done() ;
+        if (r) break ;
+        flow_update() ;
+        if (io[0].paused) break ;
       }
     }
   }
 
-  if (!wantexec) _exit(0) ;
-  if (buffer_len(&io[1].out) && !buffer_timed_flush_g(&io[1].out, &deadline))
+  if (!wantexec)
+  {
+    timing_log("quit") ;
+    if (backendpid)
+    {
+      fd_close(bufalloc_fd(&io[1].out)) ;
+      backend_reap() ;
+    }
+    _exit(0) ;
+  }
+  if (bufalloc_len(&io[1].out) && !bufalloc_timed_flush_g(&io[1].out, &deadline))
     strerr_diefu1sys(111, "write to server") ;
   if (ndelay_off(0) == -1 || ndelay_off(1) == -1)
     strerr_diefu1sys(111, "make fds blocking") ;
   if (wantexec >= 2)
   {
+    iopause_fd y = { .fd = fdctl, .events = IOPAUSE_READ } ;
+    tain start ;
+    char buf[OUTSIZE] ;
     int got = 0 ;
+    tain_now_g() ;
+    start = STAMP ;
+    deadline_set(&deadline, timeout_handshake) ;
     if (write(fdctl, "Y", 1) != 1)
       strerr_diefu1sys(111, "send ucspi-tls start command") ;
     fd_shutdown(fdctl, 1) ;
     for (;;)
     {
-      ssize_t r = fd_read(fdctl, io[1].outbuf, OUTSIZE) ;
+      ssize_t r = iopause_g(&y, 1, &deadline) ;
+      if (r == -1) strerr_diefu1sys(111, "iopause") ;
+      if (!r) timedout("handshaketimeout", "TLS handshake") ;
+      r = fd_read(fdctl, buf, OUTSIZE) ;
       if (r < 0) strerr_diefu1sys(111, "read handshake data") ;
       if (!r) break ;
       got = 1 ;
     }
-    if (!got) _exit(1) ;  /* handshake failed */
+    if (!got)  /* handshake failed */
+    {
+      rec_dump() ;
+      timing_log("handshake") ;
+      stats_inc(handshake_failures) ;
+      _exit(1) ;
+    }
+    phase_mark(PHASE_HANDSHAKE) ;
+    stats_inc(starttls) ;
+    stats_handshake(&start) ;
     fd_close(fdctl) ;
     if (fd_move2(0, sslfds[0], 1, sslfds[1]) == -1)
       strerr_diefu1sys(111, "move fds") ;
   }
-  {
-    char fmtr[UINT_FMT] ;
-    char fmtw[UINT_FMT] ;
-    char const *newargv[6] = { S6_EXTBINPREFIX "s6-ioconnect", "-r", fmtr, "-w", fmtw, 0 } ;
-    fmtr[uint_fmt(fmtr, fdr)] = 0 ;
-    fmtw[uint_fmt(fmtw, fdw)] = 0 ;
-    xexec(newargv) ;
-  }
+  phase_mark(PHASE_RELAY) ;
+#ifdef SKALIBS_HASSPLICE
+  relay(buffer_fd(&io[1].in), bufalloc_fd(&io[1].out)) ;
+#else
+  ioconnect(buffer_fd(&io[1].in), bufalloc_fd(&io[1].out)) ;
+#endif
+}
+
+static void lazy_init (char const *localname)
+{
+  static stralloc sa = STRALLOC_ZERO ;
+  size_t ehlopos, quitpos ;
+  if (!stralloc_cats(&sa, "220 ")
+   || !stralloc_cats(&sa, localname)
+   || !stralloc_catb(&sa, " ESMTP\r\n", 9)) goto err ;
+  ehlopos = sa.len ;
+  if (!stralloc_cats(&sa, "250-")
+   || !stralloc_cats(&sa, localname)
+   || !stralloc_catb(&sa, "\r\n250 STARTTLS\r\n", 17)) goto err ;
+  quitpos = sa.len ;
+  if (!stralloc_cats(&sa, "221 ")
+   || !stralloc_cats(&sa, localname)
+   || !stralloc_catb(&sa, "\r\n", 3)) goto err ;
+  lazybanner = sa.s ;
+  lazyehlo = sa.s + ehlopos ;
+  lazyquit = sa.s + quitpos ;
+  return ;
+
+ err:
+  strerr_diefu1sys(111, "stralloc_catb") ;
 }
 
 int main (int argc, char const *const *argv)
 {
-  int p[2][2] ;
-  PROG = "smtpd-starttls-proxy-io (parent)" ;
+  char const *localname = 0 ;
+  char const *timinglog = 0 ;
+  char const *statsfile = 0 ;
+  PROG = "smtpd-starttls-proxy-io" ;
   {
     subgetopt l = SUBGETOPT_ZERO ;
     for (;;)
     {
-      int opt = subgetopt_r(argc, argv, "", &l) ;
+      int opt = subgetopt_r(argc, argv, "l:c:C:t:s:i:b:m:k:r:u:", &l) ;
       if (opt == -1) break ;
       switch (opt)
       {
+        case 'l' : localname = l.arg ; break ;
+        case 'c' : ehlocache = l.arg ; break ;
+        case 'C' : if (!uint0_scan(l.arg, &ehlottl)) dieusage() ; break ;
+        case 't' : timinglog = l.arg ; break ;
+        case 's' : statsfile = l.arg ; break ;
+        case 'i' : if (!uint0_scan(l.arg, &timeout_idle)) dieusage() ; break ;
+        case 'b' : if (!uint0_scan(l.arg, &timeout_banner)) dieusage() ; break ;
+        case 'm' : if (!uint0_scan(l.arg, &timeout_command)) dieusage() ; break ;
+        case 'k' : if (!uint0_scan(l.arg, &timeout_handshake)) dieusage() ; break ;
+        case 'r' : if (!uint0_scan(l.arg, &reclines) || reclines > RECMAX) dieusage() ; break ;
+        case 'u' : backend_socket = l.arg ; break ;
         default : dieusage() ;
       }
     }
     argc -= l.ind ; argv += l.ind ;
   }
-  if (!argc) dieusage() ;
+  if (!argc && !backend_socket) dieusage() ;
 
   {
     unsigned int u ;
@@ -388,24 +1433,23 @@ int main (int argc, char const *const *argv)
     sslfds[1] = u ;
   }
 
-  if (pipe(p[0]) == -1 || pipe(p[1]) == -1)
-    strerr_diefu1sys(111, "pipe") ;
-  switch (fork())
+  if (timinglog)
   {
-    case -1 : strerr_diefu1sys(111, "fork") ;
-    case 0 :
-      close(p[0][1]) ;
-      close(p[1][0]) ;
-      child(p[0][0], p[1][1]) ;
-    default : break ;
+    unsigned int u ;
+    if (uint0_scan(timinglog, &u)) timingfd = u ;
+    else
+    {
+      timingfd = openc_append(timinglog) ;
+      if (timingfd == -1) strerr_diefu2sys(111, "open ", timinglog) ;
+    }
   }
 
-  close(p[1][1]) ;
-  close(p[0][0]) ;
-  close(fdctl) ;
-  close(sslfds[1]) ;
-  close(sslfds[0]) ;
-  if (fd_move2(0, p[1][0], 1, p[0][1]) == -1)
-    strerr_diefu1sys(111, "move fds") ;
-  xexec(argv) ;
+  if (statsfile) stats_init(statsfile) ;
+  if (reclines) rec_init() ;
+
+  if (coe(fdctl) == -1 || coe(sslfds[0]) == -1 || coe(sslfds[1]) == -1)
+    strerr_diefu1sys(111, "coe") ;
+  if (localname) lazy_init(localname) ;
+  backend_argv = argv ;
+  proxy() ;
 }
@@ -0,0 +1,67 @@
+/* ISC license. */
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <skalibs/types.h>
+#include <skalibs/buffer.h>
+#include <skalibs/strerr.h>
+#include <skalibs/djbunix.h>
+
+#include "smtpd-starttls-proxy-stats.h"
+
+#define USAGE "smtpd-starttls-proxy-stats statsfile"
+#define dieusage() strerr_dieusage(100, USAGE)
+
+static void put (char const *name, uint64_t const *p)
+{
+  char fmt[UINT64_FMT] ;
+  size_t m = uint64_fmt(fmt, sstpstats_get(p)) ;
+  if (buffer_puts(buffer_1, name) == -1
+   || buffer_put(buffer_1, " ", 1) == -1
+   || buffer_put(buffer_1, fmt, m) == -1
+   || buffer_put(buffer_1, "\n", 1) == -1)
+    strerr_diefu1sys(111, "write to stdout") ;
+}
+
+int main (int argc, char const *const *argv)
+{
+  struct stat st ;
+  sstpstats const *stats ;
+  int fd ;
+  PROG = "smtpd-starttls-proxy-stats" ;
+  if (argc < 2) dieusage() ;
+
+  fd = open_read(argv[1]) ;
+  if (fd == -1) strerr_diefu2sys(111, "open ", argv[1]) ;
+  if (fstat(fd, &st) == -1) strerr_diefu2sys(111, "stat ", argv[1]) ;
+  if (st.st_size < (off_t)sizeof(sstpstats)) strerr_dief2x(100, argv[1], " is not a smtpd-starttls-proxy-io stats file") ;
+  stats = mmap(0, sizeof(sstpstats), PROT_READ, MAP_SHARED, fd, 0) ;
+  if (stats == MAP_FAILED) strerr_diefu2sys(111, "mmap ", argv[1]) ;
+  fd_close(fd) ;
+  if (memcmp(stats->magic, SSTPSTATS_MAGIC, 8)) strerr_dief2x(100, argv[1], " is not a smtpd-starttls-proxy-io stats file") ;
+
+  put("sessions", &stats->sessions) ;
+  put("starttls", &stats->starttls) ;
+  put("notls", &stats->notls) ;
+  put("native", &stats->native) ;
+  put("timeouts", &stats->timeouts) ;
+  put("handshake_failures", &stats->handshake_failures) ;
+  for (unsigned int i = 0 ; i < SSTPSTATS_HISTO ; i++)
+  {
+    char name[16 + UINT_FMT] = "handshake_lt_" ;
+    size_t m = 13 ;
+    if (i == SSTPSTATS_HISTO - 1)
+    {
+      memcpy(name, "handshake_ge_", 13) ;
+      m += uint_fmt(name + m, 1U << (i - 1)) ;
+    }
+    else m += uint_fmt(name + m, 1U << i) ;
+    memcpy(name + m, "ms", 3) ;
+    put(name, stats->handshake_ms + i) ;
+  }
+  if (!buffer_flush(buffer_1)) strerr_diefu1sys(111, "write to stdout") ;
+  return 0 ;
+}
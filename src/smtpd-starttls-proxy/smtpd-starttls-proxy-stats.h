@@ -0,0 +1,33 @@
+/* ISC license. */
+
+#ifndef SMTPD_STARTTLS_PROXY_STATS_H
+#define SMTPD_STARTTLS_PROXY_STATS_H
+
+#include <stdint.h>
+
+ /*
+   Layout of the counters file shared by all smtpd-starttls-proxy-io
+   processes. It is mmapped, and every counter is updated atomically,
+   so no locking is needed. Fields are only ever appended.
+ */
+
+#define SSTPSTATS_MAGIC "sstpst01"
+#define SSTPSTATS_HISTO 16  /* handshake latency buckets: < 2^i ms, then the rest */
+
+typedef struct sstpstats_s sstpstats, *sstpstats_ref ;
+struct sstpstats_s
+{
+  char magic[8] ;
+  uint64_t sessions ;
+  uint64_t starttls ;
+  uint64_t notls ;
+  uint64_t native ;
+  uint64_t timeouts ;
+  uint64_t handshake_failures ;
+  uint64_t handshake_ms[SSTPSTATS_HISTO] ;
+} ;
+
+#define sstpstats_inc(p) __atomic_fetch_add((p), 1, __ATOMIC_RELAXED)
+#define sstpstats_get(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+
+#endif
@@ -0,0 +1,63 @@
+/* ISC license. */
+
+#ifndef SMTPD_STARTTLS_PROXY_VERB_H
+#define SMTPD_STARTTLS_PROXY_VERB_H
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+ /*
+   Verb recognition for the pre-TLS dialogue. The verb is what comes
+   before the first space or end of line; nothing after it is read.
+   All the verbs we know are 4 letters, except STARTTLS. A 4-byte verb
+   is folded to lowercase and dispatched as a single word: the compiler
+   makes a jump table or a decision tree out of the switch, no string
+   compare needed. OR-ing with 0x20 only maps letters to letters, so
+   no other byte can fold into a verb.
+ */
+
+enum sstpverb_e
+{
+  SSTPVERB_UNKNOWN,
+  SSTPVERB_DATA,
+  SSTPVERB_EHLO,
+  SSTPVERB_EXPN,
+  SSTPVERB_HELO,
+  SSTPVERB_HELP,
+  SSTPVERB_MAIL,
+  SSTPVERB_NOOP,
+  SSTPVERB_QUIT,
+  SSTPVERB_RCPT,
+  SSTPVERB_RSET,
+  SSTPVERB_STARTTLS,
+  SSTPVERB_VRFY,
+  SSTPVERB_N
+} ;
+
+#define SSTPVERB_WORD(a, b, c, d) ((uint32_t)(a) << 24 | (uint32_t)(b) << 16 | (uint32_t)(c) << 8 | (uint32_t)(d))
+#define SSTPVERB_FOLD(s, i) ((unsigned char)(s)[i] | 0x20)
+
+static inline enum sstpverb_e sstpverb (char const *s)
+{
+  size_t len = strcspn(s, " \r\n") ;
+  if (len == 8) return strncasecmp(s, "starttls", 8) ? SSTPVERB_UNKNOWN : SSTPVERB_STARTTLS ;
+  if (len != 4) return SSTPVERB_UNKNOWN ;
+  switch (SSTPVERB_WORD(SSTPVERB_FOLD(s, 0), SSTPVERB_FOLD(s, 1), SSTPVERB_FOLD(s, 2), SSTPVERB_FOLD(s, 3)))
+  {
+    case SSTPVERB_WORD('d', 'a', 't', 'a') : return SSTPVERB_DATA ;
+    case SSTPVERB_WORD('e', 'h', 'l', 'o') : return SSTPVERB_EHLO ;
+    case SSTPVERB_WORD('e', 'x', 'p', 'n') : return SSTPVERB_EXPN ;
+    case SSTPVERB_WORD('h', 'e', 'l', 'o') : return SSTPVERB_HELO ;
+    case SSTPVERB_WORD('h', 'e', 'l', 'p') : return SSTPVERB_HELP ;
+    case SSTPVERB_WORD('m', 'a', 'i', 'l') : return SSTPVERB_MAIL ;
+    case SSTPVERB_WORD('n', 'o', 'o', 'p') : return SSTPVERB_NOOP ;
+    case SSTPVERB_WORD('q', 'u', 'i', 't') : return SSTPVERB_QUIT ;
+    case SSTPVERB_WORD('r', 'c', 'p', 't') : return SSTPVERB_RCPT ;
+    case SSTPVERB_WORD('r', 's', 'e', 't') : return SSTPVERB_RSET ;
+    case SSTPVERB_WORD('v', 'r', 'f', 'y') : return SSTPVERB_VRFY ;
+    default : return SSTPVERB_UNKNOWN ;
+  }
+}
+
+#endif
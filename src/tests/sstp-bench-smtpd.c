@@ -0,0 +1,85 @@
+/* ISC license. */
+
+#include <string.h>
+#include <strings.h>
+
+#include <skalibs/sgetopt.h>
+#include <skalibs/buffer.h>
+#include <skalibs/strerr.h>
+
+ /*
+   The server side of sstp-bench: a scripted SMTP server that says yes
+   to everything and swallows what comes after DATA. It never speaks
+   unless spoken to, so the client can run the dialogue in lockstep.
+   Lines longer than 1 KB are an error: sstp-bench never sends any.
+   With -p, it first reads the PROXY header that smtpd-starttls-proxy-io
+   -u sends, as a server in a pool would.
+ */
+
+#define USAGE "sstp-bench-smtpd [ -p ]"
+#define dieusage() strerr_dieusage(100, USAGE)
+
+static void answer (char const *s)
+{
+  if (!buffer_puts(buffer_1, s) || !buffer_flush(buffer_1))
+    strerr_diefu1sys(111, "write to stdout") ;
+}
+
+int main (int argc, char const *const *argv)
+{
+  int indata = 0 ;
+  int proxyheader = 0 ;
+  PROG = "sstp-bench-smtpd" ;
+  {
+    subgetopt l = SUBGETOPT_ZERO ;
+    for (;;)
+    {
+      int opt = subgetopt_r(argc, argv, "p", &l) ;
+      if (opt == -1) break ;
+      switch (opt)
+      {
+        case 'p' : proxyheader = 1 ; break ;
+        default : dieusage() ;
+      }
+    }
+  }
+  if (proxyheader)
+  {
+    char line[1024] ;
+    size_t len = 0 ;
+    int r = getlnmax(buffer_0, line, 1023, &len, '\n') ;
+    if (r == -1) strerr_diefu1sys(111, "read from stdin") ;
+    if (!r || len < 6 || memcmp(line, "PROXY ", 6)) strerr_dief1x(1, "no PROXY header") ;
+  }
+  answer("220 bench ESMTP\r\n") ;
+  for (;;)
+  {
+    char line[1024] ;
+    size_t len = 0 ;
+    int r = getlnmax(buffer_0, line, 1023, &len, '\n') ;
+    if (r == -1) strerr_diefu1sys(111, "read from stdin") ;
+    if (!r) return 0 ;
+    line[len] = 0 ;
+    if (indata)
+    {
+      if (!strcmp(line, ".\r\n"))
+      {
+        answer("250 accepted\r\n") ;
+        indata = 0 ;
+      }
+    }
+    else if (!strncasecmp(line, "EHLO", 4))
+      answer("250-bench\r\n250-PIPELINING\r\n250 8BITMIME\r\n") ;
+    else if (!strncasecmp(line, "DATA", 4))
+    {
+      answer("354 go ahead\r\n") ;
+      indata = 1 ;
+    }
+    else if (!strncasecmp(line, "QUIT", 4))
+    {
+      answer("221 bench\r\n") ;
+      return 0 ;
+    }
+    else answer("250 ok\r\n") ;
+  }
+}
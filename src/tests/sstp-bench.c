@@ -0,0 +1,388 @@
+/* ISC license. */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <skalibs/gccattributes.h>
+#include <skalibs/types.h>
+#include <skalibs/allreadwrite.h>
+#include <skalibs/posixplz.h>
+#include <skalibs/sgetopt.h>
+#include <skalibs/buffer.h>
+#include <skalibs/alloc.h>
+#include <skalibs/stralloc.h>
+#include <skalibs/env.h>
+#include <skalibs/strerr.h>
+#include <skalibs/tai.h>
+#include <skalibs/djbunix.h>
+#include <skalibs/iopause.h>
+#include <skalibs/cspawn.h>
+#include <skalibs/socket.h>
+#include <skalibs/skamisc.h>
+
+#define USAGE "sstp-bench [ -n sessions ] [ -c concurrency ] [ -s datasize ] [ -u socket ] proxy..."
+#define dieusage() strerr_dieusage(100, USAGE)
+
+ /*
+   Runs smtpd-starttls-proxy-io sessions against local stand-ins, no
+   network, no TLS. For every session, sstp-bench is the UCSPI-TLS
+   parent: it gives the proxy its control socket and TLS pipes, and
+   fakes the handshake by answering the "Y" command with a few bytes.
+   It is also the client: plaintext EHLO and STARTTLS, then a mail
+   transaction with datasize bytes of DATA through the "TLS" pipes.
+   proxy... is the proxy's command line, including the server, which
+   is normally sstp-bench-smtpd.
+
+   Reports sessions per second, the p50 and p99 times between sending
+   STARTTLS and reading the 220, and the relay throughput, measured
+   from the start of DATA to the 250 after the final dot.
+
+   With -u, sstp-bench also plays the server pool: it listens on
+   socket, and for every connection runs the last word of proxy...
+   with -p, so it reads the PROXY header first. proxy... should then
+   include -u socket. The sessions stay in plaintext, so the proxy
+   relays between two sockets, which it leaves to s6-ioconnect. The
+   latency reported is from spawning the proxy to reading the banner.
+ */
+
+#define LINELEN 80
+#define BLOCKSIZE (100 * LINELEN)
+
+static char const *const *proxy_argv ;
+static char const *upath = 0 ;
+static stralloc modif = STRALLOC_ZERO ;
+static size_t datasize = 1048560 ;
+static char block[BLOCKSIZE] ;
+
+static uint64_t usec_since (tain const *start)
+{
+  tain d ;
+  tain_now_g() ;
+  tain_sub(&d, &STAMP, start) ;
+  return tai_sec(tain_secp(&d)) * 1000000 + d.nano / 1000 ;
+}
+
+static void command (int fd, char const *s)
+{
+  size_t len = strlen(s) ;
+  if (allwrite(fd, s, len) < len) strerr_diefu1sys(111, "write to proxy") ;
+}
+
+static void expect (buffer *b, char const *code)
+{
+  for (;;)
+  {
+    char line[1024] ;
+    size_t len = 0 ;
+    int r = getlnmax(b, line, 1023, &len, '\n') ;
+    if (r == -1) strerr_diefu1sys(111, "read from proxy") ;
+    if (!r) strerr_dief1x(1, "proxy closed the connection") ;
+    line[len] = 0 ;
+    if (len < 4 || memcmp(line, code, 3)) strerr_dief4x(1, "expected ", code, ", got: ", line) ;
+    if (line[3] == ' ') return ;
+  }
+}
+
+static void transaction (int fd, buffer *b, uint64_t *relay)
+{
+  tain start ;
+  command(fd, "MAIL FROM:<bench@example.com>\r\n") ;
+  expect(b, "250") ;
+  command(fd, "RCPT TO:<sink@example.com>\r\n") ;
+  expect(b, "250") ;
+  command(fd, "DATA\r\n") ;
+  expect(b, "354") ;
+  tain_now_g() ;
+  start = STAMP ;
+  for (size_t n = datasize ; n ;)
+  {
+    size_t m = n < BLOCKSIZE ? n : BLOCKSIZE ;
+    if (allwrite(fd, block, m) < m) strerr_diefu1sys(111, "write to proxy") ;
+    n -= m ;
+  }
+  command(fd, ".\r\n") ;
+  expect(b, "250") ;
+  *relay = usec_since(&start) ;
+  command(fd, "QUIT\r\n") ;
+  expect(b, "221") ;
+}
+
+static void session (uint64_t *lat, uint64_t *relay)
+{
+  int cs[2], ctl[2], rd[2], wr[2] ;
+  cspawn_fileaction fa[5] =
+  {
+    { .type = CSPAWN_FA_MOVE, .x = { .fd2 = { [0] = 0 } } },
+    { .type = CSPAWN_FA_COPY, .x = { .fd2 = { [0] = 1, [1] = 0 } } },
+    { .type = CSPAWN_FA_MOVE, .x = { .fd2 = { [0] = 3 } } },
+    { .type = CSPAWN_FA_MOVE, .x = { .fd2 = { [0] = 4 } } },
+    { .type = CSPAWN_FA_MOVE, .x = { .fd2 = { [0] = 5 } } }
+  } ;
+  char plainbuf[1024] ;
+  char tlsbuf[1024] ;
+  buffer plain, tls ;
+  tain start ;
+  pid_t pid ;
+  int wstat ;
+  char c ;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, cs) == -1
+   || socketpair(AF_UNIX, SOCK_STREAM, 0, ctl) == -1)
+    strerr_diefu1sys(111, "socketpair") ;
+  if (coe(cs[0]) == -1 || coe(cs[1]) == -1 || coe(ctl[0]) == -1 || coe(ctl[1]) == -1)
+    strerr_diefu1sys(111, "coe") ;
+  if (pipecoe(rd) == -1 || pipecoe(wr) == -1) strerr_diefu1sys(111, "pipe") ;
+  fa[0].x.fd2[1] = cs[1] ;
+  fa[2].x.fd2[1] = ctl[1] ;
+  fa[3].x.fd2[1] = rd[0] ;
+  fa[4].x.fd2[1] = wr[1] ;
+  tain_now_g() ;
+  start = STAMP ;
+  pid = mspawn_m(proxy_argv, modif.s, modif.len, 0, fa, 5) ;
+  if (!pid) strerr_diefu2sys(111, "spawn ", proxy_argv[0]) ;
+  fd_close(cs[1]) ;
+  fd_close(ctl[1]) ;
+  fd_close(rd[0]) ;
+  fd_close(wr[1]) ;
+
+  buffer_init(&plain, &buffer_read, cs[0], plainbuf, 1024) ;
+  expect(&plain, "220") ;
+  if (upath) *lat = usec_since(&start) ;
+  command(cs[0], "EHLO bench\r\n") ;
+  expect(&plain, "250") ;
+  if (upath)
+  {
+    fd_close(ctl[0]) ;
+    transaction(cs[0], &plain, relay) ;
+  }
+  else
+  {
+    tain_now_g() ;
+    start = STAMP ;
+    command(cs[0], "STARTTLS\r\n") ;
+    expect(&plain, "220") ;
+    *lat = usec_since(&start) ;
+
+    if (fd_read(ctl[0], &c, 1) != 1 || c != 'Y')
+      strerr_dief1x(1, "proxy did not send the ucspi-tls start command") ;
+    if (allwrite(ctl[0], "bench\n", 6) < 6) strerr_diefu1sys(111, "write handshake data") ;
+    fd_close(ctl[0]) ;
+
+    buffer_init(&tls, &buffer_read, wr[0], tlsbuf, 1024) ;
+    command(rd[1], "EHLO bench\r\n") ;
+    expect(&tls, "250") ;
+    transaction(rd[1], &tls, relay) ;
+  }
+
+  fd_close(rd[1]) ;
+  fd_close(wr[0]) ;
+  fd_close(cs[0]) ;
+  if (wait_pid(pid, &wstat) == -1) strerr_diefu1sys(111, "waitpid") ;
+  if (!WIFEXITED(wstat) || WEXITSTATUS(wstat)) strerr_dief1x(1, "proxy did not exit cleanly") ;
+}
+
+static void worker (unsigned int n, int fd) gccattr_noreturn ;
+static void worker (unsigned int n, int fd)
+{
+  while (n--)
+  {
+    char pack[16] ;
+    uint64_t lat, relay ;
+    session(&lat, &relay) ;
+    uint64_pack(pack, lat) ;
+    uint64_pack(pack + 8, relay) ;
+    if (allwrite(fd, pack, 16) < 16) strerr_diefu1sys(111, "write to parent") ;
+  }
+  _exit(0) ;
+}
+
+ /*
+   The pool runs until the write end of its pipe, which only the main
+   process holds, is closed: at the end, or when sstp-bench dies.
+ */
+
+static pid_t pool (int *fdw)
+{
+  char const *argv[3] = { 0, "-p", 0 } ;
+  iopause_fd x[2] = { { .events = IOPAUSE_READ }, { .events = IOPAUSE_READ } } ;
+  tain deadline ;
+  unsigned int n = 0 ;
+  pid_t pid ;
+  int p[2] ;
+  int s = ipc_stream_coe() ;
+  if (s == -1) strerr_diefu1sys(111, "create socket") ;
+  unlink_void(upath) ;
+  if (ipc_bind(s, upath) == -1 || ipc_listen(s, SOMAXCONN) == -1)
+    strerr_diefu2sys(111, "listen on ", upath) ;
+  if (pipecoe(p) == -1) strerr_diefu1sys(111, "pipe") ;
+  pid = fork() ;
+  if (pid == -1) strerr_diefu1sys(111, "fork") ;
+  if (pid)
+  {
+    fd_close(s) ;
+    fd_close(p[0]) ;
+    *fdw = p[1] ;
+    return pid ;
+  }
+  fd_close(p[1]) ;
+  while (proxy_argv[n]) n++ ;
+  argv[0] = proxy_argv[n-1] ;
+  x[0].fd = p[0] ;
+  x[1].fd = s ;
+  tain_add_g(&deadline, &tain_infinite_relative) ;
+  for (;;)
+  {
+    int wstat ;
+    if (iopause_g(x, 2, &deadline) == -1) strerr_diefu1sys(111, "iopause") ;
+    if (x[0].revents) _exit(0) ;
+    if (x[1].revents & IOPAUSE_READ)
+    {
+      cspawn_fileaction fa[2] =
+      {
+        { .type = CSPAWN_FA_MOVE, .x = { .fd2 = { [0] = 0 } } },
+        { .type = CSPAWN_FA_COPY, .x = { .fd2 = { [0] = 1, [1] = 0 } } }
+      } ;
+      int trunc ;
+      int fd = ipc_accept(s, 0, 0, &trunc) ;
+      if (fd == -1) strerr_diefu2sys(111, "accept on ", upath) ;
+      fa[0].x.fd2[1] = fd ;
+      if (!mspawn_m(argv, 0, 0, 0, fa, 2)) strerr_diefu2sys(111, "spawn ", argv[0]) ;
+      fd_close(fd) ;
+    }
+    while (wait_nohang(&wstat) > 0) ;
+  }
+}
+
+static int uint64_cmp (void const *a, void const *b)
+{
+  uint64_t const *x = a ;
+  uint64_t const *y = b ;
+  return *x < *y ? -1 : *x > *y ;
+}
+
+static void put (char const *s)
+{
+  if (!buffer_puts(buffer_1, s)) strerr_diefu1sys(111, "write to stdout") ;
+}
+
+static void putnum (uint64_t u)
+{
+  char fmt[UINT64_FMT] ;
+  fmt[uint64_fmt(fmt, u)] = 0 ;
+  put(fmt) ;
+}
+
+int main (int argc, char const *const *argv)
+{
+  unsigned int sessions = 1000 ;
+  unsigned int conc = 1 ;
+  uint64_t *lat ;
+  uint64_t relaytotal = 0 ;
+  uint64_t wall ;
+  tain start ;
+  pid_t poolpid = 0 ;
+  int poolfd = -1 ;
+  int p[2] ;
+  PROG = "sstp-bench" ;
+  {
+    subgetopt l = SUBGETOPT_ZERO ;
+    for (;;)
+    {
+      int opt = subgetopt_r(argc, argv, "n:c:s:u:", &l) ;
+      if (opt == -1) break ;
+      switch (opt)
+      {
+        case 'n' : if (!uint0_scan(l.arg, &sessions)) dieusage() ; break ;
+        case 'c' : if (!uint0_scan(l.arg, &conc)) dieusage() ; break ;
+        case 's' : if (!size0_scan(l.arg, &datasize)) dieusage() ; break ;
+        case 'u' : upath = l.arg ; break ;
+        default : dieusage() ;
+      }
+    }
+    argc -= l.ind ; argv += l.ind ;
+  }
+  if (!argc || !sessions || !conc) dieusage() ;
+  if (conc > sessions) conc = sessions ;
+  datasize = (datasize + LINELEN - 1) / LINELEN * LINELEN ;  /* whole lines only */
+  proxy_argv = argv ;
+
+ /* the proxy gets its fds as 3, 4 and 5: keep our own fds above that */
+  for (;;)
+  {
+    int fd = open_read("/dev/null") ;
+    if (fd == -1) strerr_diefu2sys(111, "open ", "/dev/null") ;
+    if (fd > 5)
+    {
+      fd_close(fd) ;
+      break ;
+    }
+  }
+  if (!env_addmodif(&modif, "SSLCTLFD", "3")
+   || !env_addmodif(&modif, "SSLREADFD", "4")
+   || !env_addmodif(&modif, "SSLWRITEFD", "5")) strerr_diefu1sys(111, "env_addmodif") ;
+  for (size_t i = 0 ; i < BLOCKSIZE ; i += LINELEN)
+  {
+    memset(block + i, 'x', LINELEN - 2) ;
+    memcpy(block + i + LINELEN - 2, "\r\n", 2) ;
+  }
+  lat = alloc(sessions * sizeof(uint64_t)) ;
+  if (!lat) strerr_diefu1sys(111, "alloc") ;
+  if (upath) poolpid = pool(&poolfd) ;
+
+  if (pipecoe(p) == -1) strerr_diefu1sys(111, "pipe") ;
+  tain_now_set_stopwatch_g() ;
+  start = STAMP ;
+  {
+    pid_t pids[conc] ;
+    for (unsigned int i = 0 ; i < conc ; i++)
+    {
+      pids[i] = fork() ;
+      if (pids[i] == -1) strerr_diefu1sys(111, "fork") ;
+      if (!pids[i])
+      {
+        fd_close(p[0]) ;
+        if (upath) fd_close(poolfd) ;
+        worker(sessions / conc + (i < sessions % conc), p[1]) ;
+      }
+    }
+    fd_close(p[1]) ;
+    for (unsigned int i = 0 ; i < sessions ; i++)
+    {
+      char pack[16] ;
+      uint64_t relay ;
+      if (allread(p[0], pack, 16) < 16) strerr_dief1x(1, "a session failed") ;
+      uint64_unpack(pack, lat + i) ;
+      uint64_unpack(pack + 8, &relay) ;
+      relaytotal += relay ;
+    }
+    wall = usec_since(&start) ;
+    for (unsigned int i = 0 ; i < conc ; i++)
+    {
+      int wstat ;
+      if (wait_pid(pids[i], &wstat) == -1) strerr_diefu1sys(111, "waitpid") ;
+    }
+  }
+  if (upath)
+  {
+    int wstat ;
+    fd_close(poolfd) ;
+    if (wait_pid(poolpid, &wstat) == -1) strerr_diefu1sys(111, "waitpid") ;
+    unlink_void(upath) ;
+  }
+  qsort(lat, sessions, sizeof(uint64_t), &uint64_cmp) ;
+
+  put("sessions: ") ; putnum(sessions) ;
+  put(" in ") ; putnum(wall) ;
+  put(" us, ") ; putnum((uint64_t)sessions * 1000000 / (wall ? wall : 1)) ;
+  put(upath ? " sessions/s\nspawn to banner: p50 " : " sessions/s\nstarttls to 220: p50 ") ; putnum(lat[(sessions - 1) / 2]) ;
+  put(" us, p99 ") ; putnum(lat[(uint64_t)(sessions - 1) * 99 / 100]) ;
+  put(" us\nrelay: ") ; putnum(datasize) ;
+  put(" bytes per session, ") ; putnum((uint64_t)datasize * sessions / (relaytotal ? relaytotal : 1)) ;
+  put(" MB/s\n") ;
+  if (!buffer_flush(buffer_1)) strerr_diefu1sys(111, "write to stdout") ;
+  return 0 ;
+}
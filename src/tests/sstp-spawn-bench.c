@@ -0,0 +1,120 @@
+/* ISC license. */
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <skalibs/types.h>
+#include <skalibs/sgetopt.h>
+#include <skalibs/buffer.h>
+#include <skalibs/alloc.h>
+#include <skalibs/strerr.h>
+#include <skalibs/tai.h>
+#include <skalibs/djbunix.h>
+#include <skalibs/cspawn.h>
+#include <skalibs/exec.h>
+
+#define USAGE "sstp-spawn-bench [ -n spawns ] [ -m megabytes ] prog..."
+#define dieusage() strerr_dieusage(100, USAGE)
+
+ /*
+   Compares the two ways smtpd-starttls-proxy-io has started its
+   server: fork() then exec, as it used to, and mspawn_m(), which
+   uses posix_spawn() or vfork() when it can, as it does now. prog...
+   is started n times each way, with stdin and stdout on /dev/null,
+   and waited for. -m dirties that many megabytes beforehand: the
+   cost of fork() grows with the parent's address space.
+ */
+
+static int fdin ;
+static int fdout ;
+
+static void spawn_fork (char const *const *argv)
+{
+  int wstat ;
+  pid_t pid = fork() ;
+  if (pid == -1) strerr_diefu1sys(111, "fork") ;
+  if (!pid)
+  {
+    if (fd_copy(0, fdin) == -1 || fd_copy(1, fdout) == -1)
+      strerr_diefu1sys(111, "copy fds") ;
+    xexec(argv) ;
+  }
+  if (wait_pid(pid, &wstat) == -1) strerr_diefu1sys(111, "waitpid") ;
+}
+
+static void spawn_mspawn (char const *const *argv)
+{
+  cspawn_fileaction fa[2] =
+  {
+    { .type = CSPAWN_FA_COPY, .x = { .fd2 = { [0] = 0, [1] = fdin } } },
+    { .type = CSPAWN_FA_COPY, .x = { .fd2 = { [0] = 1, [1] = fdout } } }
+  } ;
+  int wstat ;
+  pid_t pid = mspawn_m(argv, 0, 0, 0, fa, 2) ;
+  if (!pid) strerr_diefu2sys(111, "spawn ", argv[0]) ;
+  if (wait_pid(pid, &wstat) == -1) strerr_diefu1sys(111, "waitpid") ;
+}
+
+static void run (char const *name, void (*f)(char const *const *), char const *const *argv, unsigned int n)
+{
+  tain start, d ;
+  uint64_t usec ;
+  char fmt[UINT64_FMT] ;
+  tain_now_g() ;
+  start = STAMP ;
+  for (unsigned int i = 0 ; i < n ; i++) (*f)(argv) ;
+  tain_now_g() ;
+  tain_sub(&d, &STAMP, &start) ;
+  usec = tai_sec(tain_secp(&d)) * 1000000 + d.nano / 1000 ;
+  if (!buffer_puts(buffer_1, name)
+   || !buffer_puts(buffer_1, ": ")) goto err ;
+  fmt[uint64_fmt(fmt, usec / n)] = 0 ;
+  if (!buffer_puts(buffer_1, fmt)
+   || !buffer_puts(buffer_1, " us per spawn\n")
+   || !buffer_flush(buffer_1)) goto err ;
+  return ;
+
+ err:
+  strerr_diefu1sys(111, "write to stdout") ;
+}
+
+int main (int argc, char const *const *argv)
+{
+  unsigned int n = 1000 ;
+  unsigned int megs = 0 ;
+  PROG = "sstp-spawn-bench" ;
+  {
+    subgetopt l = SUBGETOPT_ZERO ;
+    for (;;)
+    {
+      int opt = subgetopt_r(argc, argv, "n:m:", &l) ;
+      if (opt == -1) break ;
+      switch (opt)
+      {
+        case 'n' : if (!uint0_scan(l.arg, &n)) dieusage() ; break ;
+        case 'm' : if (!uint0_scan(l.arg, &megs)) dieusage() ; break ;
+        default : dieusage() ;
+      }
+    }
+    argc -= l.ind ; argv += l.ind ;
+  }
+  if (!argc || !n) dieusage() ;
+
+  fdin = open_readb("/dev/null") ;
+  if (fdin == -1 || coe(fdin) == -1) strerr_diefu2sys(111, "open ", "/dev/null") ;
+  fdout = open_write("/dev/null") ;
+  if (fdout == -1 || coe(fdout) == -1) strerr_diefu2sys(111, "open ", "/dev/null") ;
+  if (megs)
+  {
+    char *p = alloc((size_t)megs << 20) ;
+    if (!p) strerr_diefu1sys(111, "alloc") ;
+    memset(p, 1, (size_t)megs << 20) ;
+  }
+
+  tain_now_set_stopwatch_g() ;
+  run("fork+exec", &spawn_fork, argv, n) ;
+  run("mspawn", &spawn_mspawn, argv, n) ;
+  return 0 ;
+}
@@ -0,0 +1,112 @@
+/* ISC license. */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <skalibs/types.h>
+#include <skalibs/buffer.h>
+#include <skalibs/strerr.h>
+#include <skalibs/tai.h>
+
+#include "../smtpd-starttls-proxy/smtpd-starttls-proxy-verb.h"
+
+ /*
+   Checks the pre-TLS verb dispatch on stdout, for run-test.sh to diff,
+   then measures how many lines per second it parses, on stderr.
+ */
+
+#define ROUNDS 2000000
+
+static char const *const names[SSTPVERB_N] =
+{
+  "unknown", "data", "ehlo", "expn", "helo", "help", "mail",
+  "noop", "quit", "rcpt", "rset", "starttls", "vrfy"
+} ;
+
+static char const *const lines[] =
+{
+  "\n",
+  "Q\n",
+  "QUI\r\n",
+  "quit\r\n",
+  "QUITX\r\n",
+  "Quit now\r\n",
+  " QUIT\r\n",
+  "STAR\r\n",
+  "STARTTLS\r\n",
+  "starttls\n",
+  "StartTLS please\r\n",
+  "STARTTLSX\r\n",
+  "EHLO example.com\r\n",
+  "ehlo\r\n",
+  "HELO example.com\r\n",
+  "HELP\r\n",
+  "MAIL FROM:<a@example.com>\r\n",
+  "MAILFROM:<a@example.com>\r\n",
+  "RCPT TO:<b@example.com>\r\n",
+  "DATA\r\n",
+  "NOOP\r\n",
+  "RSET\r\n",
+  "VRFY postmaster\r\n",
+  "EXPN staff\r\n",
+  "E(LO\r\n",
+  "[HLO\r\n",
+  "EHL\017\r\n",
+  0
+} ;
+
+ /* what a scanner sends, and what a real client sends before STARTTLS */
+static char const *const benchlines[] =
+{
+  "EHLO scanner\r\n",
+  "HELP\r\n",
+  "QUIT\r\n",
+  "GET / HTTP/1.0\r\n",
+  "\r\n",
+  "EHLO mx.example.com\r\n",
+  "NOOP\r\n",
+  "STARTTLS\r\n"
+} ;
+
+static void put_escaped (char const *s)
+{
+  for (; *s ; s++)
+  {
+    if (*s == '\r') buffer_putsnoflush(buffer_1, "\\r") ;
+    else if (*s == '\n') buffer_putsnoflush(buffer_1, "\\n") ;
+    else if ((unsigned char)*s < 32) buffer_putsnoflush(buffer_1, "\\?") ;
+    else buffer_putnoflush(buffer_1, s, 1) ;
+  }
+}
+
+int main (void)
+{
+  PROG = "sstp-verb-test" ;
+  for (unsigned int i = 0 ; lines[i] ; i++)
+  {
+    put_escaped(lines[i]) ;
+    buffer_putsnoflush(buffer_1, " ") ;
+    buffer_putsnoflush(buffer_1, names[sstpverb(lines[i])]) ;
+    buffer_putsnoflush(buffer_1, "\n") ;
+  }
+  if (!buffer_flush(buffer_1)) strerr_diefu1sys(111, "write to stdout") ;
+
+  {
+    static unsigned int const n = sizeof(benchlines) / sizeof(char const *) ;
+    volatile unsigned int sink = 0 ;
+    tain start, d ;
+    uint64_t usec ;
+    char fmt[UINT64_FMT] ;
+    tain_now_set_stopwatch_g() ;
+    start = STAMP ;
+    for (unsigned int r = 0 ; r < ROUNDS ; r++)
+      for (unsigned int i = 0 ; i < n ; i++) sink += sstpverb(benchlines[i]) ;
+    tain_now_g() ;
+    tain_sub(&d, &STAMP, &start) ;
+    usec = tai_sec(tain_secp(&d)) * 1000000 + d.nano / 1000 ;
+    fmt[uint64_fmt(fmt, (uint64_t)ROUNDS * n * 1000000 / (usec ? usec : 1))] = 0 ;
+    strerr_warni3x("dispatch: ", fmt, " lines/s") ;
+    (void)sink ;
+  }
+  return 0 ;
+}